@@ -0,0 +1,138 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Per-operation cost of libsstore compared to raw system calls.
+ * usage: bench_libsstore [ops] [size] [batch]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <future>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libsstore.h"
+
+
+static int ops = 200000;
+static int size = 32;
+static unsigned batch = 64;
+static int nblobs = 5;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed) {
+  printf("%-22s %i writes of %i bytes: %.3f s, %.0f ns/op\n",
+         name, ops, size, elapsed, elapsed * 1e9 / ops);
+}
+
+/* the baseline, a hand-filled data_buffer per write() */
+static void bench_raw(const char *path, const char *data) {
+  struct data_buffer buf;
+  double start;
+  int fd, i;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  buf.size = size;
+  buf.data = const_cast<char *>(data);
+
+  start = now();
+  for (i = 0; i < ops; i++) {
+    buf.index = i % nblobs;
+    if (write(fd, &buf, sizeof (struct data_buffer)) < 0) {
+      perror("write");
+      exit(1);
+    }
+  }
+  report("raw write()", now() - start);
+  close(fd);
+}
+
+static void bench_device(const char *path, const char *data) {
+  sstore::Device dev(path);
+  double start;
+  int i;
+
+  start = now();
+  for (i = 0; i < ops; i++)
+    dev.write(i % nblobs, data, size);
+  report("Device::write", now() - start);
+}
+
+/* one doorbell per operation, the worst case for the rings */
+static void bench_client_sync(const char *path, const char *data) {
+  sstore::Client client(path, batch, batch);
+  double start;
+  int i;
+
+  start = now();
+  for (i = 0; i < ops; i++)
+    client.write(i % nblobs, data, size);
+  report("Client::write", now() - start);
+}
+
+/* one doorbell per 'batch' operations */
+static void bench_client_async(const char *path, const char *data) {
+  sstore::Client client(path, batch, batch);
+  std::deque<std::future<int> > results;
+  double start;
+  int i;
+
+  start = now();
+  for (i = 0; i < ops; i++) {
+    results.push_back(client.write_async(i % nblobs, data, size));
+    /* futures of flushed batches are ready, don't let them pile up */
+    while (!results.empty() && results.size() > 2 * batch)
+      results.pop_front();
+  }
+  client.flush();
+  report("Client::write_async", now() - start);
+}
+
+int main(int argc, char **argv) {
+  const char *path = "/dev/sstore0";
+  FILE *f;
+  std::vector<char> data;
+
+  if (argc > 1) ops = atoi(argv[1]);
+  if (argc > 2) size = atoi(argv[2]);
+  if (argc > 3) batch = atoi(argv[3]);
+  if (ops < 1 || size < 1 || size > sstore::max_blob_size() || batch < 1) {
+    fprintf(stderr, "usage: %s [ops] [size] [batch]\n", argv[0]);
+    return 1;
+  }
+
+  f = fopen("/sys/module/sstore/parameters/max_num_blobs", "r");
+  if (f) {
+    if (fscanf(f, "%d", &nblobs) != 1 || nblobs < 1)
+      nblobs = 5;
+    fclose(f);
+  }
+
+  data.assign(size, 'x');
+  try {
+    bench_raw(path, &data[0]);
+    bench_device(path, &data[0]);
+    bench_client_sync(path, &data[0]);
+    bench_client_async(path, &data[0]);
+  } catch (const std::system_error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
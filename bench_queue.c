@@ -0,0 +1,156 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Hand-off throughput of the sstore queue mode compared to a pipe.
+ * usage: bench_queue [messages] [size] [producers] [consumers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include "sstore.h"
+
+
+static int messages = 1000000;
+static int size = 32;
+static int producers = 1;
+static int consumers = 1;
+
+/* send 'count' messages through the sstore queue */
+static void sstore_producer(int fd, int count) {
+  struct data_buffer buf;
+  char *data = calloc(1, size);
+
+  buf.index = 0;
+  buf.size = size;
+  buf.data = data;
+  while (count--) {
+    if (write(fd, &buf, sizeof (struct data_buffer)) < 0) {
+      perror("write");
+      exit(1);
+    }
+  }
+}
+
+/* receive 'count' messages from the sstore queue */
+static void sstore_consumer(int fd, int count) {
+  struct data_buffer buf;
+  char *data = malloc(size);
+
+  buf.index = 0;
+  buf.size = size;
+  buf.data = data;
+  while (count--) {
+    if (read(fd, &buf, sizeof (struct data_buffer)) < 0) {
+      perror("read");
+      exit(1);
+    }
+  }
+}
+
+/* messages are at most PIPE_BUF bytes, so each write is atomic */
+static void pipe_producer(int fd, int count) {
+  char *data = calloc(1, size);
+
+  while (count--) {
+    if (write(fd, data, size) != size) {
+      perror("write");
+      exit(1);
+    }
+  }
+}
+
+static void pipe_consumer(int fd, int count) {
+  char *data = malloc(size);
+  int got, n;
+
+  while (count--) {
+    for (got = 0; got < size; got += n) {
+      n = read(fd, data + got, size - got);
+      if (n <= 0) {
+        perror("read");
+        exit(1);
+      }
+    }
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fork the producers and consumers and time the whole hand-off */
+static void run(const char *name, int rfd, int wfd,
+                void (*producer)(int, int), void (*consumer)(int, int)) {
+  double start, elapsed;
+  int i;
+
+  start = now();
+  for (i = 0; i < producers; i++) {
+    if (fork() == 0) {
+      producer(wfd, messages / producers);
+      exit(0);
+    }
+  }
+  for (i = 0; i < consumers; i++) {
+    if (fork() == 0) {
+      consumer(rfd, messages / consumers);
+      exit(0);
+    }
+  }
+  while (wait(NULL) > 0)
+    ;
+  elapsed = now() - start;
+
+  printf("%-7s %i msgs of %i bytes, %iP/%iC: %.3f s, %.0f msgs/s\n",
+         name, messages, size, producers, consumers, elapsed,
+         messages / elapsed);
+}
+
+int main(int argc, char **argv) {
+  int fd, p[2];
+
+  if (argc > 1) messages = atoi(argv[1]);
+  if (argc > 2) size = atoi(argv[2]);
+  if (argc > 3) producers = atoi(argv[3]);
+  if (argc > 4) consumers = atoi(argv[4]);
+  if (producers < 1 || consumers < 1 || size < 1) {
+    fprintf(stderr, "usage: %s [messages] [size] [producers] [consumers]\n",
+            argv[0]);
+    return 1;
+  }
+
+  /* every producer and consumer moves the same number of messages */
+  messages -= messages % (producers * consumers);
+
+  fd = open("/dev/sstore1", O_RDWR);
+  if (fd < 0) {
+    perror("opening sstore1");
+    return 1;
+  }
+  if (ioctl(fd, SSTORE_IOCQUEUE) < 0) {
+    perror("SSTORE_IOCQUEUE");
+    return 1;
+  }
+  run("sstore", fd, fd, sstore_producer, sstore_consumer);
+  close(fd);
+
+  if (pipe(p) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  run("pipe", p[0], p[1], pipe_producer, pipe_consumer);
+
+  return 0;
+}
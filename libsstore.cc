@@ -0,0 +1,342 @@
+/*
+ * libsstore.cc
+ *
+ * C++ client library for the sstore devices.
+ *
+ * Copyright (C) 2010 Abdelhalim Ragab <abdelhalim@r8t.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include "libsstore.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+namespace sstore {
+
+namespace {
+
+void throw_errno(int err, const char *what) {
+  throw std::system_error(err, std::generic_category(), what);
+}
+
+}  // namespace
+
+int max_blob_size(int fallback) {
+  FILE *f = std::fopen("/sys/module/sstore/parameters/max_blob_size", "r");
+  int size;
+
+  if (!f)
+    return fallback;
+  if (std::fscanf(f, "%d", &size) != 1 || size <= 0)
+    size = fallback;
+  std::fclose(f);
+  return size;
+}
+
+/* Device */
+
+Device::Device(const std::string &path, int flags) {
+  fd_ = ::open(path.c_str(), flags);
+  if (fd_ < 0)
+    throw_errno(errno, path.c_str());
+}
+
+Device::~Device() {
+  if (fd_ >= 0)
+    ::close(fd_);
+}
+
+Device::Device(Device &&other) noexcept : fd_(other.fd_) {
+  other.fd_ = -1;
+}
+
+Device &Device::operator=(Device &&other) noexcept {
+  if (this != &other) {
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = other.fd_;
+    other.fd_ = -1;
+  }
+  return *this;
+}
+
+int Device::write(int index, const void *data, int size, unsigned ttl_ms) {
+  data_buffer_ttl req;
+  ssize_t n;
+
+  req.buf.index = index;
+  req.buf.size = size;
+  req.buf.data = static_cast<char *>(const_cast<void *>(data));
+  req.ttl_ms = ttl_ms;
+
+  /* the short request keeps working with modules without ttl support */
+  if (ttl_ms)
+    n = ::write(fd_, &req, sizeof (data_buffer_ttl));
+  else
+    n = ::write(fd_, &req.buf, sizeof (data_buffer));
+  if (n < 0)
+    throw_errno(errno, "sstore write");
+  return n;
+}
+
+int Device::read(int index, void *data, int size) {
+  data_buffer req;
+  ssize_t n;
+
+  req.index = index;
+  req.size = size;
+  req.data = static_cast<char *>(data);
+  n = ::read(fd_, &req, sizeof (data_buffer));
+  if (n < 0)
+    throw_errno(errno, "sstore read");
+  return n;
+}
+
+void Device::remove(int index) {
+  if (::ioctl(fd_, SSTORE_IOCREMOVE, &index) < 0)
+    throw_errno(errno, "sstore remove");
+}
+
+void Device::enable_queue() {
+  if (::ioctl(fd_, SSTORE_IOCQUEUE) < 0)
+    throw_errno(errno, "sstore queue");
+}
+
+/* BufferPool */
+
+BufferPool::Buffer::Buffer(Buffer &&other) noexcept
+    : pool_(other.pool_), data_(other.data_) {
+  other.pool_ = nullptr;
+  other.data_ = nullptr;
+}
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    reset();
+    pool_ = other.pool_;
+    data_ = other.data_;
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+  }
+  return *this;
+}
+
+std::size_t BufferPool::Buffer::size() const {
+  return pool_ ? pool_->buffer_size() : 0;
+}
+
+void BufferPool::Buffer::reset() {
+  if (pool_)
+    pool_->release(data_);
+  pool_ = nullptr;
+  data_ = nullptr;
+}
+
+BufferPool::BufferPool(std::size_t buffer_size, std::size_t chunk_buffers)
+    : buffer_size_(buffer_size), chunk_buffers_(chunk_buffers) {
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (!buffer_size_ || !chunk_buffers_)
+    throw std::invalid_argument("sstore buffer pool size");
+  chunk_size_ = buffer_size_ * chunk_buffers_;
+  chunk_size_ = (chunk_size_ + page - 1) / page * page;
+  grow();
+}
+
+BufferPool::~BufferPool() {
+  for (char *chunk : chunks_) {
+    munlock(chunk, chunk_size_);
+    std::free(chunk);
+  }
+}
+
+void BufferPool::grow() {
+  void *chunk;
+
+  if (posix_memalign(&chunk, sysconf(_SC_PAGESIZE), chunk_size_))
+    throw std::bad_alloc();
+  /* best effort, pinning needs RLIMIT_MEMLOCK or CAP_IPC_LOCK */
+  mlock(chunk, chunk_size_);
+
+  chunks_.push_back(static_cast<char *>(chunk));
+  for (std::size_t i = 0; i < chunk_buffers_; i++)
+    free_.push_back(static_cast<char *>(chunk) + i * buffer_size_);
+}
+
+BufferPool::Buffer BufferPool::acquire() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  char *data;
+
+  if (free_.empty())
+    grow();
+  data = free_.back();
+  free_.pop_back();
+  return Buffer(this, data);
+}
+
+void BufferPool::release(char *data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(data);
+}
+
+/* Client */
+
+Client::Client(const std::string &path, unsigned ring_entries, unsigned batch)
+    : device_(path), pool_(max_blob_size(), ring_entries ? ring_entries : 1),
+      map_(MAP_FAILED), batch_(batch ? batch : 1), queued_(0) {
+  sstore_ring_params params;
+
+  params.sq_entries = ring_entries;
+  if (::ioctl(device_.fd(), SSTORE_IOCRINGSETUP, &params) < 0)
+    throw_errno(errno, "sstore ring setup");
+
+  map_size_ = params.size;
+  map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+              device_.fd(), SSTORE_MMAP_RING);
+  if (map_ == MAP_FAILED)
+    throw_errno(errno, "sstore ring mmap");
+
+  hdr_ = static_cast<sstore_ring_header *>(map_);
+  sqes_ = reinterpret_cast<sstore_sqe *>(static_cast<char *>(map_)
+                                         + hdr_->sq_off);
+  cqes_ = reinterpret_cast<sstore_cqe *>(static_cast<char *>(map_)
+                                         + hdr_->cq_off);
+
+  /* one pending slot per submission entry, a flush completes them all */
+  pending_.resize(hdr_->sq_entries);
+  for (unsigned i = hdr_->sq_entries; i > 0; i--)
+    free_slots_.push_back(i - 1);
+}
+
+Client::~Client() {
+  try {
+    flush();
+  } catch (...) {
+    /* the futures of a failed doorbell are broken, nothing else to do */
+  }
+  if (map_ != MAP_FAILED)
+    munmap(map_, map_size_);
+}
+
+unsigned Client::reserve() {
+  unsigned slot;
+
+  if (free_slots_.empty())
+    flush();
+  slot = free_slots_.back();
+  free_slots_.pop_back();
+  return slot;
+}
+
+std::future<int> Client::submit(unsigned slot, int op, int index, int size,
+                                const void *addr, unsigned ttl_ms) {
+  unsigned tail = hdr_->sq_tail;
+  sstore_sqe *sqe = &sqes_[tail & (hdr_->sq_entries - 1)];
+  std::future<int> result = pending_[slot].promise.get_future();
+
+  sqe->user_data = slot;
+  sqe->addr = reinterpret_cast<unsigned long>(addr);
+  sqe->op = op;
+  sqe->index = index;
+  sqe->size = size;
+  sqe->ttl_ms = ttl_ms;
+
+  /* the entry must be visible before the new tail */
+  __atomic_store_n(&hdr_->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (++queued_ >= batch_)
+    flush();
+  return result;
+}
+
+std::future<int> Client::write_async(int index, const void *data, int size,
+                                     unsigned ttl_ms) {
+  BufferPool::Buffer buffer;
+  unsigned slot;
+
+  if (size < 0 || static_cast<std::size_t>(size) > pool_.buffer_size())
+    throw std::invalid_argument("sstore write size");
+
+  buffer = pool_.acquire();
+  std::memcpy(buffer.data(), data, size);
+
+  slot = reserve();
+  pending_[slot].buffer = std::move(buffer);
+  return submit(slot, SSTORE_OP_WRITE, index, size,
+                pending_[slot].buffer.data(), ttl_ms);
+}
+
+std::future<int> Client::read_async(int index, void *data, int size) {
+  return submit(reserve(), SSTORE_OP_READ, index, size, data, 0);
+}
+
+std::future<int> Client::remove_async(int index) {
+  return submit(reserve(), SSTORE_OP_REMOVE, index, 0, nullptr, 0);
+}
+
+int Client::write(int index, const void *data, int size, unsigned ttl_ms) {
+  std::future<int> result = write_async(index, data, size, ttl_ms);
+
+  flush();
+  return result.get();
+}
+
+int Client::read(int index, void *data, int size) {
+  std::future<int> result = read_async(index, data, size);
+
+  flush();
+  return result.get();
+}
+
+void Client::flush() {
+  while (queued_) {
+    int n = ::ioctl(device_.fd(), SSTORE_IOCRINGENTER);
+
+    if (n < 0)
+      throw_errno(errno, "sstore ring enter");
+    queued_ -= n;
+    /* a full completion ring stops the doorbell early, make room */
+    reap();
+  }
+}
+
+/* complete the futures of the posted completions */
+void Client::reap() {
+  unsigned head = hdr_->cq_head;
+  unsigned tail = __atomic_load_n(&hdr_->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    const sstore_cqe &cqe = cqes_[head & (hdr_->cq_entries - 1)];
+    unsigned slot = cqe.user_data;
+    Pending &pending = pending_[slot];
+
+    if (cqe.res < 0) {
+      pending.promise.set_exception(std::make_exception_ptr(
+        std::system_error(-cqe.res, std::generic_category(), "sstore op")));
+    } else {
+      pending.promise.set_value(cqe.res);
+    }
+    pending.promise = std::promise<int>();
+    pending.buffer.reset();
+    free_slots_.push_back(slot);
+  }
+
+  __atomic_store_n(&hdr_->cq_head, head, __ATOMIC_RELEASE);
+}
+
+}  // namespace sstore
@@ -0,0 +1,177 @@
+/*
+ * libsstore.h
+ *
+ * C++ client library for the sstore devices.
+ *
+ * Copyright (C) 2010 Abdelhalim Ragab <abdelhalim@r8t.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#ifndef LIBSSTORE_H
+#define LIBSSTORE_H
+
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "sstore.h"
+
+namespace sstore {
+
+/* max_blob_size of the loaded module, from sysfs, or 'fallback' */
+int max_blob_size(int fallback = 4096);
+
+/*
+ * An open sstore device
+ * Opens the device once and closes it when destroyed. The synchronous
+ * operations map to one system call each and throw std::system_error on
+ * failure.
+ */
+class Device {
+ public:
+  explicit Device(const std::string &path = "/dev/sstore0",
+                  int flags = O_RDWR);
+  ~Device();
+
+  Device(Device &&other) noexcept;
+  Device &operator=(Device &&other) noexcept;
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+
+  int fd() const { return fd_; }
+
+  /* returns the number of bytes written */
+  int write(int index, const void *data, int size, unsigned ttl_ms = 0);
+  /* blocks until there is a blob at index, returns the bytes read */
+  int read(int index, void *data, int size);
+  void remove(int index);
+  /* switch the device to FIFO queue mode, see SSTORE_IOCQUEUE */
+  void enable_queue();
+
+ private:
+  int fd_;
+};
+
+/*
+ * Pool of fixed-size buffers
+ * Buffers are allocated in page-aligned chunks, locked in memory when
+ * possible so the kernel never faults on them, and recycled instead of
+ * freed. The pool grows by one chunk when it runs out. Thread safe.
+ */
+class BufferPool {
+ public:
+  /* a buffer on loan from the pool, given back when destroyed */
+  class Buffer {
+   public:
+    Buffer() : pool_(nullptr), data_(nullptr) {}
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { reset(); }
+
+    char *data() const { return data_; }
+    std::size_t size() const;
+    void reset();
+
+   private:
+    friend class BufferPool;
+    Buffer(BufferPool *pool, char *data) : pool_(pool), data_(data) {}
+
+    BufferPool *pool_;
+    char *data_;
+  };
+
+  BufferPool(std::size_t buffer_size, std::size_t chunk_buffers = 64);
+  ~BufferPool();
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  Buffer acquire();
+  std::size_t buffer_size() const { return buffer_size_; }
+
+ private:
+  void grow();
+  void release(char *data);
+
+  std::size_t buffer_size_;
+  std::size_t chunk_buffers_;
+  std::size_t chunk_size_;
+  std::mutex mutex_;
+  std::vector<char *> chunks_;
+  std::vector<char *> free_;
+};
+
+/*
+ * Batched asynchronous client
+ * Operations are queued on the submission ring of a private file
+ * descriptor and executed with one doorbell system call per batch. Each
+ * one returns a future that becomes ready when the batch is flushed, and
+ * throws std::system_error from get() if the operation failed.
+ * The batch is flushed when 'batch' operations are queued, when the ring
+ * is full, on flush(), and on destruction. Not thread safe, use one
+ * client per thread.
+ */
+class Client {
+ public:
+  explicit Client(const std::string &path = "/dev/sstore0",
+                  unsigned ring_entries = 256, unsigned batch = 64);
+  ~Client();
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+
+  /* the data is copied to a pooled buffer, the caller may reuse it */
+  std::future<int> write_async(int index, const void *data, int size,
+                               unsigned ttl_ms = 0);
+  /* 'data' must stay valid until the future is ready, reads don't block
+     and fail with EAGAIN if there is no blob at index */
+  std::future<int> read_async(int index, void *data, int size);
+  std::future<int> remove_async(int index);
+
+  /* queue one operation and flush right away */
+  int write(int index, const void *data, int size, unsigned ttl_ms = 0);
+  int read(int index, void *data, int size);
+
+  /* execute everything queued and complete the futures */
+  void flush();
+  unsigned queued() const { return queued_; }
+
+  Device &device() { return device_; }
+
+ private:
+  struct Pending {
+    std::promise<int> promise;
+    BufferPool::Buffer buffer;
+  };
+
+  unsigned reserve();
+  std::future<int> submit(unsigned slot, int op, int index, int size,
+                          const void *addr, unsigned ttl_ms);
+  void reap();
+
+  Device device_;
+  BufferPool pool_;
+  void *map_;
+  std::size_t map_size_;
+  sstore_ring_header *hdr_;
+  sstore_sqe *sqes_;
+  sstore_cqe *cqes_;
+  unsigned batch_;
+  unsigned queued_;
+  std::vector<Pending> pending_;
+  std::vector<unsigned> free_slots_;
+};
+
+}  // namespace sstore
+
+#endif
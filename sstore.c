@@ -22,6 +22,16 @@
 #include <linux/sched.h> /* current and everthing */
 #include <linux/timer.h> /* timer */
 #include <linux/kthread.h> /* kthread stuff */
+#include <linux/ktime.h> /* latency measurements */
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/jhash.h> /* dedup payload hashing */
+#include <linux/rbtree.h> /* ordered index */
+#include <linux/cache.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/crc32.h> /* write-ahead log checksums */
+#include <linux/time.h>
 
 
 #include "sstore.h"
@@ -33,6 +43,37 @@ static int max_blob_size = 64;
 module_param(max_num_blobs, int, S_IRUGO);
 module_param(max_blob_size, int, S_IRUGO);
 
+/* share one buffer between blobs with identical contents */
+static int dedup = 0;
+module_param(dedup, int, S_IRUGO);
+
+/* number of messages a device holds in queue mode, rounded up to a power
+   of two */
+static int queue_depth = 256;
+module_param(queue_depth, int, S_IRUGO);
+#define SSTORE_QUEUE_MAX_DEPTH     (1 << 16)
+
+/* number of records in the per-device change log, rounded up to a power
+   of two, 0 disables it */
+static int changelog_size = 1024;
+module_param(changelog_size, int, S_IRUGO);
+#define SSTORE_CHANGELOG_MAX       (1 << 20)
+
+/* durability, writes and removes are appended to a write-ahead log in
+   '<wal_path>.0' or '<wal_path>.1' and replayed on load, unset disables it */
+static char *wal_path;
+module_param(wal_path, charp, S_IRUGO);
+
+/* 0: never fsync the log, 1: fsync every group commit, 2: fsync once a
+   second */
+static int wal_fsync = 1;
+module_param(wal_fsync, int, S_IRUGO);
+
+/* the log is compacted once it grows past 'wal_compact_kb', 0 only
+   compacts on load */
+static int wal_compact_kb = 1024;
+module_param(wal_compact_kb, int, S_IRUGO);
+
 /* statisics are cleared ever 'clear_time' seconds */
 static int clear_time = 60; 
 
@@ -41,6 +82,11 @@ static struct task_struct *clear_thread_ptr;
 static wait_queue_head_t clear_thread_wait;
 static char timer_off;
 
+/* expired blobs are swept by clear_thread, 'expire_timer' runs one
+   SSTORE_WHEEL_TICK at a time while some blob has a time-to-live */
+static struct timer_list expire_timer;
+static char expire_pending;
+
 
 
 
@@ -48,27 +94,665 @@ static char timer_off;
    and removed in the release */
 struct proc_dir_entry *sstore_proc;
 
+/* debugfs sstore directory, holds one instrumentation file per device */
+static struct dentry *sstore_debugfs;
+
+/* Shared, immutable blob contents in dedup mode, protected by sstore_mutex */
+struct sstore_payload {
+  struct hlist_node node;         /* dedup hash chain */
+  u32  hash;
+  int  refs;                      /* blobs pointing at this payload */
+  int  size;
+  char data[0];
+};
+
+/*
+ * FIFO queue mode, a bounded multi-producer/multi-consumer ring
+ * Each slot carries a sequence number: a slot is free for the producer of
+ * position pos when seq == pos, and holds the message of position pos when
+ * seq == pos + 1. Producers and consumers claim positions by advancing tail
+ * and head with cmpxchg, copy the message without holding any lock, then
+ * publish the slot by moving its sequence forward. Sleeping is only needed
+ * when the ring is full or empty.
+ */
+struct sstore_queue_slot {
+  unsigned long seq;
+  int  size;                      /* message size, -1 if the copy faulted */
+  char *data;                     /* max_blob_size bytes */
+};
+
+struct sstore_queue {
+  unsigned long head ____cacheline_aligned;   /* next position to dequeue */
+  unsigned long tail ____cacheline_aligned;   /* next position to enqueue */
+  unsigned long mask ____cacheline_aligned;   /* number of slots - 1 */
+  wait_queue_head_t not_empty;
+  wait_queue_head_t not_full;
+  struct sstore_queue_slot *slots;
+  char *buffers;
+};
+
+#define SSTORE_DEDUP_HASH_BITS     8
+#define SSTORE_DEDUP_HASH_SIZE     (1 << SSTORE_DEDUP_HASH_BITS)
+
 struct blob {
   char *data;
-  int  size;
+  int  size;                      /* bytes in use */
+  int  capacity;                  /* bytes allocated for data, 0 if shared */
+  struct sstore_payload *payload; /* shared contents in dedup mode */
+  int  index;                     /* slot holding this blob */
+  struct rb_node node;            /* ordered index, by slot */
+  unsigned long expires;          /* jiffies, 0 if the blob has no ttl */
+  struct list_head expiry;        /* timer wheel slot */
+};
+
+/*
+ * Timer wheel for blob expiry
+ * A blob with a time-to-live sits in the slot of the tick it expires in,
+ * modulo the wheel size. A sweep visits only the slots of the ticks that
+ * passed since the previous one, and leaves the blobs that are due on a
+ * later turn of the wheel, so expiry never scans the whole store.
+ */
+#define SSTORE_WHEEL_BITS          8
+#define SSTORE_WHEEL_SIZE          (1 << SSTORE_WHEEL_BITS)
+#define SSTORE_WHEEL_TICK          (HZ / 10 ? HZ / 10 : 1)
+
+/*
+ * Latency histograms, bucket i counts the samples that took
+ * [2^i, 2^(i+1)) nanoseconds, the last bucket is open ended
+ */
+#define SSTORE_HIST_BUCKETS        32
+
+enum sstore_hist_id {
+  SSTORE_HIST_READ,               /* read() service time */
+  SSTORE_HIST_WRITE,              /* write() service time */
+  SSTORE_HIST_REMOVE,             /* SSTORE_IOCREMOVE service time */
+  SSTORE_HIST_BLOCKED,            /* time readers slept waiting for data */
+  SSTORE_HIST_LOCK_WAIT,          /* time spent acquiring sstore_mutex */
+  SSTORE_HIST_LOCK_HOLD,          /* time sstore_mutex was held */
+  SSTORE_NUM_HISTS
+};
+
+static const char *sstore_hist_names[SSTORE_NUM_HISTS] = {
+  "read", "write", "remove", "blocked", "lock_wait", "lock_hold"
+};
+
+struct sstore_hist {
+  u64 count;
+  u64 sum_ns;
+  u64 max_ns;
+  u64 buckets[SSTORE_HIST_BUCKETS];
+};
+
+/* Instrumentation, protected by stats_lock and never touched by the
+   clear timer, it is only reset through debugfs */
+struct sstore_stats {
+  struct sstore_hist hist[SSTORE_NUM_HISTS];
+  u64 lock_contended;             /* sstore_mutex was already taken */
+  u64 alloc_failures;             /* failed kmalloc/kzalloc calls */
+  u64 wakeups;                    /* wake ups issued to blocked readers */
+  u64 overwrites_inplace;         /* overwrites that reused the blob buffer */
+  u64 overwrites_replaced;        /* overwrites that needed a new blob */
 };
 
 
 
+/* Submission/completion rings of an open file, see sstore_ring_enter() */
+struct sstore_ring {
+  struct sstore_ring_header *hdr; /* vmalloc_user, mapped by the client */
+  struct sstore_sqe *sqes;
+  struct sstore_cqe *cqes;
+  unsigned int sq_mask, cq_mask;
+  unsigned int sq_head;           /* next submission to execute */
+  unsigned int cq_tail;           /* next completion to post */
+};
+
 /* Per-device structure */
 struct sstore_dev {
   void **data;
-  unsigned short current_pointer; /* Current pointer */
+  char *scratch;                  /* max_blob_size staging buffer, used
+                                     under sstore_mutex */
+  struct rb_root index;           /* occupied slots in order */
+  struct list_head wheel[SSTORE_WHEEL_SIZE]; /* blobs by expiry tick */
+  unsigned long wheel_time;       /* jiffies of the last sweep */
+  unsigned long nexpiring;        /* blobs with a ttl */
+  unsigned long nexpired;         /* blobs removed by expiry */
+  struct hlist_head *dedup_hash;  /* payloads by content, dedup mode */
+  unsigned long dedup_payloads;   /* distinct payloads stored */
+  unsigned long dedup_saved;      /* bytes saved by sharing payloads */
+  struct sstore_queue *queue;     /* FIFO queue mode, NULL in store mode */
+  struct sstore_changelog_header *changelog; /* change log, user mappable,
+                                     written under sstore_mutex */
+  struct sstore_change *changes;  /* change log records */
+  unsigned long changelog_mask;   /* number of records - 1 */
+  unsigned long long changelog_head; /* newest sequence, the mapped
+                                     header only gets a copy */
   unsigned int size;              /* Size */
   int store_number;               /* store number */
   int nreads, nwrites;	          /* number of reads/writes */
   char name[10];		  /* Name */
   struct cdev cdev;               /* The cdev structure */
   struct mutex sstore_mutex;
+  ktime_t lock_acquired;          /* when sstore_mutex was taken */
   wait_queue_head_t wq;
   atomic_t refcount;
+  spinlock_t stats_lock;
+  struct sstore_stats stats;
+  struct dentry *debugfs_entry;
 } *sstore_devp[NUM_MINOR_DEVICES];
 
+/* Per-open-file structure */
+struct sstore_file {
+  struct sstore_dev *dev;         /* the device this file refers to */
+  struct mutex ring_mutex;        /* serializes ring setup and doorbells */
+  struct sstore_ring *ring;       /* submission/completion rings, or NULL */
+};
+
+/*
+ * Write-ahead log
+ * The log file starts with a header naming its generation, followed by one
+ * record per write or remove, each with the data written. A record is only
+ * valid if its checksum matches, so replay stops at a torn tail.
+ * Writers copy their record to the pending buffer under the device mutex,
+ * in the same order the store changes, and wait for the log thread. The
+ * log thread swaps the buffers and writes (and fsyncs) the whole group at
+ * once while the next group fills the other buffer.
+ * Compaction writes a snapshot of the live blobs to the other log file,
+ * then its header, so the old log stays valid until the new one is.
+ */
+#define SSTORE_WAL_MAGIC           0x57414c31   /* "WAL1" */
+#define SSTORE_WAL_RECORD_MAGIC    0x52454331   /* "REC1" */
+#define SSTORE_WAL_BUF_SIZE        (64 * 1024)
+
+struct sstore_wal_header {
+  u32 magic;
+  u32 crc;                        /* crc32 of generation */
+  u64 generation;                 /* the newest valid log wins */
+};
+
+struct sstore_wal_record {
+  u32 magic;
+  u32 crc;                        /* crc32 of the fields below and the data */
+  u64 expires_ms;                 /* wall clock expiry, 0 for none */
+  u16 op;                         /* SSTORE_CHANGE_WRITE or _REMOVE */
+  u16 dev;
+  s32 index;
+  s32 size;
+  u32 pad;
+};
+
+#define SSTORE_WAL_LEN(size)       (sizeof (struct sstore_wal_record) + (size))
+
+struct sstore_wal {
+  struct file *file;              /* active log, only used by the thread */
+  int active;                     /* suffix of the active log */
+  u64 generation;
+  loff_t pos;                     /* end of the active log */
+  loff_t compact_at;              /* compact when pos grows past it */
+  unsigned long synced;           /* jiffies of the last fsync */
+  int dirty;                      /* written since the last fsync */
+  struct task_struct *thread;
+  wait_queue_head_t wait;         /* the thread waits for records */
+  wait_queue_head_t space;        /* writers wait for buffer space */
+  wait_queue_head_t done;         /* writers wait for their group */
+  spinlock_t lock;                /* protects the fields below */
+  char *buf[2];                   /* writers fill buf[cur] */
+  int cur;
+  int size;                       /* bytes in each buffer */
+  int used;                       /* bytes in buf[cur] */
+  int reserved;                   /* bytes promised to writers */
+  u64 lsn;                        /* last record appended */
+  u64 durable_lsn;                /* last record written to the log */
+  int error;                      /* first log error, fails later writes */
+  unsigned long groups, syncs, compactions;
+};
+
+/* NULL unless wal_path is set, and until the log has been replayed */
+static struct sstore_wal *sstore_wal;
+
+
+/* allocate a blob with room for 'size' bytes of data */
+static struct blob *
+sstore_blob_alloc(int size)
+{
+  struct blob *blob;
+
+  blob = kmalloc(sizeof (struct blob), GFP_KERNEL);
+  if (!blob)
+    return NULL;
+
+  /* allocate memory for the blob data itself */
+  blob->data = kmalloc(size, GFP_KERNEL);
+  if (!blob->data) {
+    kfree(blob);
+    return NULL;
+  }
+  blob->size = size;
+  blob->capacity = size;
+  blob->payload = NULL;
+  blob->expires = 0;
+  INIT_LIST_HEAD(&blob->expiry);
+  return blob;
+}
+
+/*
+ * Find the payload holding 'data', or create it, and take a reference.
+ * Called under sstore_mutex.
+ */
+static struct sstore_payload *
+sstore_dedup_get(struct sstore_dev *dev, const char *data, int size)
+{
+  u32 hash = jhash(data, size, 0);
+  struct hlist_head *head = &dev->dedup_hash[hash & (SSTORE_DEDUP_HASH_SIZE - 1)];
+  struct hlist_node *pos;
+  struct sstore_payload *payload;
+
+  hlist_for_each_entry(payload, pos, head, node) {
+    if (payload->hash == hash && payload->size == size
+        && !memcmp(payload->data, data, size)) {
+      payload->refs++;
+      dev->dedup_saved += size;
+      return payload;
+    }
+  }
+
+  payload = kmalloc(sizeof (struct sstore_payload) + size, GFP_KERNEL);
+  if (!payload)
+    return NULL;
+  payload->hash = hash;
+  payload->refs = 1;
+  payload->size = size;
+  memcpy(payload->data, data, size);
+  hlist_add_head(&payload->node, head);
+  dev->dedup_payloads++;
+  return payload;
+}
+
+/* drop a payload reference, called under sstore_mutex */
+static void
+sstore_dedup_put(struct sstore_dev *dev, struct sstore_payload *payload)
+{
+  if (--payload->refs) {
+    dev->dedup_saved -= payload->size;
+    return;
+  }
+  hlist_del(&payload->node);
+  dev->dedup_payloads--;
+  kfree(payload);
+}
+
+/* free a blob, blobs sharing a payload must be freed under sstore_mutex */
+static void
+sstore_blob_free(struct sstore_dev *dev, struct blob *blob)
+{
+  if (blob->payload)
+    sstore_dedup_put(dev, blob->payload);
+  else
+    kfree(blob->data);
+  kfree(blob);
+}
+
+/*
+ * Ordered index of the occupied slots, protected by sstore_mutex
+ * It lets range scans skip empty slots instead of walking the array.
+ */
+static void
+sstore_index_insert(struct sstore_dev *dev, struct blob *blob, int index)
+{
+  struct rb_node **link = &dev->index.rb_node, *parent = NULL;
+  struct blob *entry;
+
+  blob->index = index;
+  while (*link) {
+    parent = *link;
+    entry = rb_entry(parent, struct blob, node);
+    if (index < entry->index)
+      link = &parent->rb_left;
+    else
+      link = &parent->rb_right;
+  }
+  rb_link_node(&blob->node, parent, link);
+  rb_insert_color(&blob->node, &dev->index);
+}
+
+/* first occupied slot at or after 'index' */
+static struct blob *
+sstore_index_lookup(struct sstore_dev *dev, int index)
+{
+  struct rb_node *node = dev->index.rb_node;
+  struct blob *entry, *found = NULL;
+
+  while (node) {
+    entry = rb_entry(node, struct blob, node);
+    if (index <= entry->index) {
+      found = entry;
+      node = node->rb_left;
+    } else {
+      node = node->rb_right;
+    }
+  }
+  return found;
+}
+
+/*
+ * Append a record to the change log, called under sstore_mutex
+ * Readers of the mapped log check that the record sequence is the one they
+ * expect before and after reading it, so the sequence is cleared while the
+ * record is rewritten and set again last. The header head moves after that.
+ */
+static void
+sstore_changelog_add(struct sstore_dev *dev, int op, int index, int size)
+{
+  struct sstore_changelog_header *hdr = dev->changelog;
+  struct sstore_change *rec;
+  unsigned long long seq;
+
+  if (!hdr)
+    return;
+
+  seq = dev->changelog_head + 1;
+  rec = &dev->changes[(seq - 1) & dev->changelog_mask];
+  rec->seq = 0;
+  smp_wmb();
+  rec->op = op;
+  rec->index = index;
+  rec->size = size;
+  smp_wmb();
+  rec->seq = seq;
+  smp_wmb();
+  dev->changelog_head = seq;
+  hdr->head = seq;
+}
+
+/*
+ * Set the time-to-live of a blob, 0 clears it, called under sstore_mutex
+ */
+static void
+sstore_blob_set_ttl(struct sstore_dev *dev, struct blob *blob,
+                    unsigned int ttl_ms)
+{
+  if (blob->expires) {
+    list_del_init(&blob->expiry);
+    dev->nexpiring--;
+  }
+  blob->expires = 0;
+  if (!ttl_ms)
+    return;
+
+  /* 0 means no ttl, don't let jiffies wrap onto it */
+  blob->expires = (jiffies + msecs_to_jiffies(ttl_ms)) | 1;
+  list_add_tail(&blob->expiry,
+    &dev->wheel[(blob->expires / SSTORE_WHEEL_TICK) & (SSTORE_WHEEL_SIZE - 1)]);
+  dev->nexpiring++;
+
+  if (!timer_pending(&expire_timer))
+    mod_timer(&expire_timer, jiffies + SSTORE_WHEEL_TICK);
+}
+
+/* the blob time-to-live has run out */
+static int
+sstore_blob_expired(struct blob *blob)
+{
+  return blob->expires && time_after_eq(jiffies, blob->expires);
+}
+
+static void sstore_blob_expire(struct sstore_dev *dev, struct blob *blob);
+
+/* the blob at 'index', expired blobs are removed lazily on access,
+   called under sstore_mutex */
+static struct blob *
+sstore_blob_lookup(struct sstore_dev *dev, int index)
+{
+  struct blob *blob = dev->data[index];
+
+  if (blob && sstore_blob_expired(blob)) {
+    sstore_blob_expire(dev, blob);
+    blob = NULL;
+  }
+  return blob;
+}
+
+/* remove an expired blob from the store, called under sstore_mutex */
+static void
+sstore_blob_expire(struct sstore_dev *dev, struct blob *blob)
+{
+  int index = blob->index;
+
+  dev->data[index] = NULL;
+  rb_erase(&blob->node, &dev->index);
+  sstore_blob_set_ttl(dev, blob, 0);
+  sstore_blob_free(dev, blob);
+  dev->nexpired++;
+  sstore_changelog_add(dev, SSTORE_CHANGE_EXPIRE, index, 0);
+}
+
+/*
+ * Remove the blobs that expired since the previous sweep, called under
+ * sstore_mutex
+ */
+static void
+sstore_expire_sweep(struct sstore_dev *dev)
+{
+  unsigned long now = jiffies;
+  unsigned long tick = dev->wheel_time / SSTORE_WHEEL_TICK;
+  unsigned long ticks = now / SSTORE_WHEEL_TICK - tick + 1;
+  struct blob *blob, *next;
+  struct list_head *slot;
+
+  /* a full turn of the wheel visits every slot */
+  if (ticks > SSTORE_WHEEL_SIZE)
+    ticks = SSTORE_WHEEL_SIZE;
+
+  for (; ticks; ticks--, tick++) {
+    slot = &dev->wheel[tick & (SSTORE_WHEEL_SIZE - 1)];
+    list_for_each_entry_safe(blob, next, slot, expiry) {
+      if (time_after_eq(now, blob->expires))
+        sstore_blob_expire(dev, blob);
+    }
+  }
+  dev->wheel_time = now;
+}
+
+/* add one sample to a latency histogram of the device */
+static void
+sstore_hist_add(struct sstore_dev *dev, enum sstore_hist_id id,
+                ktime_t start, ktime_t end)
+{
+  struct sstore_hist *hist = &dev->stats.hist[id];
+  s64 delta = ktime_to_ns(ktime_sub(end, start));
+  u64 ns = delta > 0 ? delta : 0;
+  int bucket = ns ? fls64(ns) - 1 : 0;
+
+  if (bucket >= SSTORE_HIST_BUCKETS)
+    bucket = SSTORE_HIST_BUCKETS - 1;
+
+  spin_lock(&dev->stats_lock);
+  hist->count++;
+  hist->sum_ns += ns;
+  if (ns > hist->max_ns)
+    hist->max_ns = ns;
+  hist->buckets[bucket]++;
+  spin_unlock(&dev->stats_lock);
+}
+
+/* count a failed memory allocation */
+static void
+sstore_alloc_failed(struct sstore_dev *dev)
+{
+  spin_lock(&dev->stats_lock);
+  dev->stats.alloc_failures++;
+  spin_unlock(&dev->stats_lock);
+}
+
+/* wake all sleeping readers on this device */
+static void
+sstore_wake_readers(struct sstore_dev *dev)
+{
+  spin_lock(&dev->stats_lock);
+  dev->stats.wakeups++;
+  spin_unlock(&dev->stats_lock);
+
+  wake_up_interruptible(&dev->wq);
+}
+
+/*
+ * Acquire/release the device mutex, recording how long we waited
+ * for it, how long it was held, and whether it was contended
+ */
+static void
+sstore_lock(struct sstore_dev *dev)
+{
+  ktime_t start = ktime_get();
+
+  if (!mutex_trylock(&dev->sstore_mutex)) {
+    spin_lock(&dev->stats_lock);
+    dev->stats.lock_contended++;
+    spin_unlock(&dev->stats_lock);
+    mutex_lock(&dev->sstore_mutex);
+  }
+  dev->lock_acquired = ktime_get();
+  sstore_hist_add(dev, SSTORE_HIST_LOCK_WAIT, start, dev->lock_acquired);
+}
+
+static void
+sstore_unlock(struct sstore_dev *dev)
+{
+  ktime_t acquired = dev->lock_acquired;
+
+  mutex_unlock(&dev->sstore_mutex);
+  sstore_hist_add(dev, SSTORE_HIST_LOCK_HOLD, acquired, ktime_get());
+}
+
+/* wall clock time in ms, log expiry must survive a reboot */
+static u64
+sstore_wal_now_ms(void)
+{
+  struct timeval tv;
+
+  do_gettimeofday(&tv);
+  return (u64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* take 'len' bytes of the pending buffer, or the log error */
+static int
+sstore_wal_try_reserve(struct sstore_wal *wal, int len)
+{
+  int ok = 0;
+
+  spin_lock(&wal->lock);
+  if (wal->error || wal->used + wal->reserved + len <= wal->size) {
+    if (!wal->error)
+      wal->reserved += len;
+    ok = 1;
+  }
+  spin_unlock(&wal->lock);
+  return ok;
+}
+
+/*
+ * Make room for a record of 'size' bytes of data before taking the device
+ * mutex, so appending under the mutex never has to wait for the log thread
+ */
+static int
+sstore_wal_reserve(int size)
+{
+  struct sstore_wal *wal = sstore_wal;
+
+  if (!wal)
+    return 0;
+  wait_event(wal->space, sstore_wal_try_reserve(wal, SSTORE_WAL_LEN(size)));
+  if (wal->error) {
+    printk(KERN_DEBUG "sstore: write-ahead log failed, refusing writes\n");
+    return -EIO;
+  }
+  return 0;
+}
+
+/* give back a reservation that won't be appended */
+static void
+sstore_wal_cancel(int size)
+{
+  struct sstore_wal *wal = sstore_wal;
+
+  if (!wal)
+    return;
+  spin_lock(&wal->lock);
+  wal->reserved -= SSTORE_WAL_LEN(size);
+  spin_unlock(&wal->lock);
+  wake_up_all(&wal->space);
+}
+
+/* fill a log record, 'expires_ms' is 0 for no expiry */
+static void
+sstore_wal_record(struct sstore_wal_record *rec, int op, int dev, int index,
+                  const char *data, int size, u64 expires_ms)
+{
+  rec->magic = SSTORE_WAL_RECORD_MAGIC;
+  rec->expires_ms = expires_ms;
+  rec->op = op;
+  rec->dev = dev;
+  rec->index = index;
+  rec->size = size;
+  rec->pad = 0;
+  rec->crc = crc32(~0, (unsigned char *) &rec->expires_ms,
+                   sizeof (struct sstore_wal_record)
+                   - offsetof(struct sstore_wal_record, expires_ms));
+  rec->crc = crc32(rec->crc, (unsigned char *) data, size);
+}
+
+/*
+ * Append a record to the pending group, called under sstore_mutex after
+ * a successful sstore_wal_reserve() so the log sees the changes of a slot
+ * in the order they were made. Returns the record number to wait for.
+ */
+static u64
+sstore_wal_append(struct sstore_dev *dev, int op, int index,
+                  const char *data, int size, unsigned int ttl_ms)
+{
+  struct sstore_wal *wal = sstore_wal;
+  struct sstore_wal_record rec;
+  u64 lsn;
+
+  if (!wal)
+    return 0;
+
+  sstore_wal_record(&rec, op, dev->store_number, index, data, size,
+                    ttl_ms ? sstore_wal_now_ms() + ttl_ms : 0);
+
+  spin_lock(&wal->lock);
+  memcpy(wal->buf[wal->cur] + wal->used, &rec, sizeof (rec));
+  memcpy(wal->buf[wal->cur] + wal->used + sizeof (rec), data, size);
+  wal->used += SSTORE_WAL_LEN(size);
+  wal->reserved -= SSTORE_WAL_LEN(size);
+  lsn = ++wal->lsn;
+  spin_unlock(&wal->lock);
+
+  wake_up(&wal->wait);
+  return lsn;
+}
+
+static int
+sstore_wal_durable(struct sstore_wal *wal, u64 lsn)
+{
+  int done;
+
+  spin_lock(&wal->lock);
+  done = wal->error || wal->durable_lsn >= lsn;
+  spin_unlock(&wal->lock);
+  return done;
+}
+
+/* wait for the group holding record 'lsn' to reach the log */
+static int
+sstore_wal_wait(u64 lsn)
+{
+  struct sstore_wal *wal = sstore_wal;
+
+  if (!wal || !lsn)
+    return 0;
+  wait_event(wal->done, sstore_wal_durable(wal, lsn));
+  return wal->error ? -EIO : 0;
+}
+
 
 
 int sstore_open(struct inode *inode, struct file *file);
@@ -78,6 +762,11 @@ ssize_t sstore_write(struct file *file, const char __user *buf,
            size_t count, loff_t *ppos);
 static int sstore_ioctl(struct inode *inode, struct file *file,
            unsigned int cmd, unsigned long arg);
+static int sstore_mmap(struct file *file, struct vm_area_struct *vma);
+struct sstore_file;
+static int sstore_ring_setup(struct sstore_file *sf,
+           struct sstore_ring_params __user *u_params);
+static int sstore_ring_enter(struct sstore_file *sf);
 
 /* operation prototype for the /proc fs */
 int sstore_read_procmem(char *buf, char **start, off_t offset,
@@ -85,9 +774,26 @@ int sstore_read_procmem(char *buf, char **start, off_t offset,
 int sstore_read_procstats(char *buf, char **start, off_t offset,
                        int count, int *eof, void *data);
 
+/* device data, allocated on first open or on load in durable mode */
+static int sstore_alloc_data(struct sstore_dev *dev);
+void clear_data(struct sstore_dev *dev);
+
+/* write-ahead log, see sstore_wal_open() */
+static int sstore_wal_open(void);
+static void sstore_wal_close(void);
+
 static void sstore_clear_statistics(unsigned long params); 
+static void sstore_expire_timer(unsigned long params);
 static int clear_thread(void *dummy);
 
+/* instrumentation exported through debugfs */
+static int sstore_debugfs_open(struct inode *inode, struct file *file);
+static ssize_t sstore_debugfs_read(struct file *file, char __user *buf,
+           size_t count, loff_t *ppos);
+static ssize_t sstore_debugfs_write(struct file *file, const char __user *buf,
+           size_t count, loff_t *ppos);
+static int sstore_debugfs_release(struct inode *inode, struct file *file);
+
 /* File operations structure. Defined in linux/fs.h */
 static struct file_operations sstore_fops = {
   .owner    =   THIS_MODULE,        /* Owner */
@@ -96,6 +802,17 @@ static struct file_operations sstore_fops = {
   .read     =   sstore_read,        /* Read method */
   .write    =   sstore_write,       /* Write method */
   .ioctl    =   sstore_ioctl,       /* Ioctl method */
+  .mmap     =   sstore_mmap,        /* Mmap method */
+};
+
+/* debugfs file operations, reading returns a snapshot of the device
+   instrumentation, writing anything resets it */
+static struct file_operations sstore_debugfs_fops = {
+  .owner    =   THIS_MODULE,
+  .open     =   sstore_debugfs_open,
+  .read     =   sstore_debugfs_read,
+  .write    =   sstore_debugfs_write,
+  .release  =   sstore_debugfs_release,
 };
 
 static dev_t sstore_dev_number;   /* Allotted device number */
@@ -103,13 +820,64 @@ struct class *sstore_class;       /* Tie with the device model */
 
 #define DEVICE_NAME             "sstore"
 
+/* free the first 'n' devices, with the blobs durable devices still hold */
+static void
+sstore_free_devices(int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (!sstore_devp[i])
+      continue;
+    if (sstore_devp[i]->data) {
+      sstore_lock(sstore_devp[i]);
+      clear_data(sstore_devp[i]);
+      sstore_unlock(sstore_devp[i]);
+    }
+    if (sstore_devp[i]->changelog)
+      vfree(sstore_devp[i]->changelog);
+    kfree(sstore_devp[i]);
+    sstore_devp[i] = NULL;
+  }
+}
+
+/* undo the device number, class and the first 'n' devices on a failed
+   load, so the next insmod starts from scratch */
+static void
+sstore_init_failed(int n)
+{
+  sstore_free_devices(n);
+  class_destroy(sstore_class);
+  unregister_chrdev_region(sstore_dev_number, NUM_MINOR_DEVICES);
+}
+
+/* stop the clear thread and the timers feeding it */
+static void
+sstore_stop_clear_thread(void)
+{
+  kthread_stop(clear_thread_ptr);
+  del_timer_sync(&clear_timer);
+  del_timer_sync(&expire_timer);
+}
+
 /*
  * Driver Initialization
  */
 int __init
 sstore_init(void)
 {
-  int i, ret;
+  int i, j, ret;
+
+  /* the queue and change log sizes are rounded up to a power of two and
+     multiplied out, keep them in a sane range */
+  if (max_num_blobs <= 0 || max_blob_size <= 0
+      || queue_depth <= 0 || queue_depth > SSTORE_QUEUE_MAX_DEPTH
+      || (unsigned long) max_blob_size
+           > ULONG_MAX / roundup_pow_of_two(queue_depth)
+      || changelog_size < 0 || changelog_size > SSTORE_CHANGELOG_MAX) {
+    printk(KERN_ALERT "sstore: invalid module parameters\n");
+    return -EINVAL;
+  }
 
   /* Request dynamic allocation of a device major number */
   if (alloc_chrdev_region(&sstore_dev_number, 0,
@@ -119,12 +887,18 @@ sstore_init(void)
 
   /* Populate sysfs entries */
   sstore_class = class_create(THIS_MODULE, DEVICE_NAME);
+  if (IS_ERR(sstore_class)) {
+    printk(KERN_DEBUG "sstore: Can't create the device class\n");
+    unregister_chrdev_region(sstore_dev_number, NUM_MINOR_DEVICES);
+    return PTR_ERR(sstore_class);
+  }
 
   for (i=0; i<NUM_MINOR_DEVICES; i++) {
     /* Allocate memory for the per-device structure */
     sstore_devp[i] = kmalloc(sizeof(struct sstore_dev), GFP_KERNEL);
     if (!sstore_devp[i]) {
       printk("sstore: Bad Kmalloc\n"); 
+      sstore_init_failed(i);
       return -ENOMEM;
     }
 
@@ -133,6 +907,40 @@ sstore_init(void)
 
     /* sstore storage */
     sstore_devp[i]->data = NULL;
+    sstore_devp[i]->scratch = NULL;
+    sstore_devp[i]->queue = NULL;
+
+    /* the change log lives as long as the module, so sequence numbers
+       keep increasing across open/close cycles */
+    sstore_devp[i]->changelog = NULL;
+    sstore_devp[i]->changes = NULL;
+    sstore_devp[i]->changelog_mask = 0;
+    sstore_devp[i]->changelog_head = 0;
+    if (changelog_size > 0) {
+      unsigned long n = roundup_pow_of_two(changelog_size);
+
+      sstore_devp[i]->changelog = vmalloc_user(
+        PAGE_ALIGN(SSTORE_CHANGELOG_LEN(n)));
+      if (!sstore_devp[i]->changelog) {
+        printk("sstore: Bad vmalloc\n");
+        sstore_init_failed(i + 1);
+        return -ENOMEM;
+      }
+      sstore_devp[i]->changelog->head = 0;
+      sstore_devp[i]->changelog->nrecords = n;
+      sstore_devp[i]->changes = (struct sstore_change *)
+        (sstore_devp[i]->changelog + 1);
+      sstore_devp[i]->changelog_mask = n - 1;
+    }
+    sstore_devp[i]->index = RB_ROOT;
+    for (j = 0; j < SSTORE_WHEEL_SIZE; j++)
+      INIT_LIST_HEAD(&sstore_devp[i]->wheel[j]);
+    sstore_devp[i]->wheel_time = jiffies;
+    sstore_devp[i]->nexpiring = 0;
+    sstore_devp[i]->nexpired = 0;
+    sstore_devp[i]->dedup_hash = NULL;
+    sstore_devp[i]->dedup_payloads = 0;
+    sstore_devp[i]->dedup_saved = 0;
 
     sprintf(sstore_devp[i]->name, "sstore%d", i);
 
@@ -150,20 +958,18 @@ sstore_init(void)
     sstore_devp[i]->nreads = 0;
     sstore_devp[i]->nwrites = 0;
 
-    /* Connect the file operations with the cdev */
-    cdev_init(&sstore_devp[i]->cdev, &sstore_fops);
-    sstore_devp[i]->cdev.owner = THIS_MODULE;
+    /* initialize the instrumentation */
+    spin_lock_init(&sstore_devp[i]->stats_lock);
+    memset(&sstore_devp[i]->stats, 0, sizeof(struct sstore_stats));
+    sstore_devp[i]->debugfs_entry = NULL;
 
-    /* Connect the major/minor number to the cdev */
-    ret = cdev_add(&sstore_devp[i]->cdev, (sstore_dev_number + i), 1);
-    if (ret) {
-      printk("sstore: Bad cdev\n");
-      return ret;
+    /* durable devices hold their data from load to unload, the log is
+       replayed into it */
+    if (wal_path && sstore_alloc_data(sstore_devp[i])) {
+      printk("sstore: Bad Kmalloc\n");
+      sstore_init_failed(i + 1);
+      return -ENOMEM;
     }
-
-    /* Send uevents to udev, so it'll create /dev nodes */
-    device_create(sstore_class, NULL, MKDEV(MAJOR(sstore_dev_number), i),
-                  "sstore%d", i);
   }
 
 
@@ -172,6 +978,8 @@ sstore_init(void)
   clear_thread_ptr = kthread_run(clear_thread, NULL, "clear_thread");
   if(IS_ERR(clear_thread_ptr)) {
     printk(KERN_DEBUG "sstore: error creating thread\n");
+    sstore_init_failed(NUM_MINOR_DEVICES);
+    return PTR_ERR(clear_thread_ptr);
   }
 
   /* initialize the timer responsible for clearing statistic */
@@ -180,6 +988,47 @@ sstore_init(void)
   clear_timer.function = sstore_clear_statistics;
   clear_timer.data = 0;
   add_timer(&clear_timer);
+
+  /* armed by the first write with a time-to-live */
+  init_timer(&expire_timer);
+  expire_timer.function = sstore_expire_timer;
+  expire_timer.data = 0;
+
+  /* replay the log before anyone can open the devices */
+  if (wal_path) {
+    ret = sstore_wal_open();
+    if (ret) {
+      printk(KERN_ALERT "sstore: can't open the write-ahead log %s (%d)\n",
+             wal_path, ret);
+      sstore_stop_clear_thread();
+      sstore_init_failed(NUM_MINOR_DEVICES);
+      return ret;
+    }
+  }
+
+  for (i=0; i<NUM_MINOR_DEVICES; i++) {
+    /* Connect the file operations with the cdev */
+    cdev_init(&sstore_devp[i]->cdev, &sstore_fops);
+    sstore_devp[i]->cdev.owner = THIS_MODULE;
+
+    /* Connect the major/minor number to the cdev */
+    ret = cdev_add(&sstore_devp[i]->cdev, (sstore_dev_number + i), 1);
+    if (ret) {
+      printk("sstore: Bad cdev\n");
+      for (j = 0; j < i; j++) {
+        device_destroy(sstore_class, MKDEV(MAJOR(sstore_dev_number), j));
+        cdev_del(&sstore_devp[j]->cdev);
+      }
+      sstore_stop_clear_thread();
+      sstore_wal_close();
+      sstore_init_failed(NUM_MINOR_DEVICES);
+      return ret;
+    }
+
+    /* Send uevents to udev, so it'll create /dev nodes */
+    device_create(sstore_class, NULL, MKDEV(MAJOR(sstore_dev_number), i),
+                  "sstore%d", i);
+  }
   
 
   sstore_proc = proc_mkdir("sstore", NULL);
@@ -189,6 +1038,20 @@ sstore_init(void)
   create_proc_read_entry("stats", 0, sstore_proc, 
                          sstore_read_procstats, NULL);
 
+  /* debugfs is optional, the driver works without it */
+  sstore_debugfs = debugfs_create_dir("sstore", NULL);
+  if (sstore_debugfs && !IS_ERR(sstore_debugfs)) {
+    for (i=0; i<NUM_MINOR_DEVICES; i++) {
+      sstore_devp[i]->debugfs_entry =
+        debugfs_create_file(sstore_devp[i]->name, S_IRUSR | S_IWUSR,
+                            sstore_debugfs, sstore_devp[i],
+                            &sstore_debugfs_fops);
+    }
+  } else {
+    printk(KERN_DEBUG "sstore: debugfs not available\n");
+    sstore_debugfs = NULL;
+  }
+
   printk("sstore: SStore Driver Initialized.\n");
   return 0;
 }
@@ -206,29 +1069,55 @@ static void sstore_clear_statistics(unsigned long params)
   mod_timer(&clear_timer, jiffies + clear_time*HZ); 
 }
 
-/* clear sstore statistics */
+/*
+ * sweep expired blobs
+ */
+static void sstore_expire_timer(unsigned long params)
+{
+  expire_pending = 1;
+  wake_up_interruptible(&clear_thread_wait);
+}
+
+/* clear sstore statistics and sweep expired blobs */
 
 static int
 clear_thread(void *dummy) 
 {
   int rc;
-  int i;
+  int i, rearm;
 
   while (1) {
     rc = wait_event_interruptible(clear_thread_wait,
-             timer_off || kthread_should_stop());
+             timer_off || expire_pending || kthread_should_stop());
 
     if (kthread_should_stop() || rc == -ERESTARTSYS) {
       break;
     }
     
-    for (i=0; i<NUM_MINOR_DEVICES; i++) {
-      mutex_lock(&sstore_devp[i]->sstore_mutex);
-      sstore_devp[i]->nreads  = 0;
-      sstore_devp[i]->nwrites = 0;
-      mutex_unlock(&sstore_devp[i]->sstore_mutex);
+    if (timer_off) {
+      for (i=0; i<NUM_MINOR_DEVICES; i++) {
+        sstore_lock(sstore_devp[i]);
+        sstore_devp[i]->nreads  = 0;
+        sstore_devp[i]->nwrites = 0;
+        sstore_unlock(sstore_devp[i]);
+      }
+      timer_off = 0;
+    }
+
+    if (expire_pending) {
+      expire_pending = 0;
+      rearm = 0;
+      for (i=0; i<NUM_MINOR_DEVICES; i++) {
+        sstore_lock(sstore_devp[i]);
+        if (sstore_devp[i]->nexpiring)
+          sstore_expire_sweep(sstore_devp[i]);
+        rearm |= sstore_devp[i]->nexpiring != 0;
+        sstore_unlock(sstore_devp[i]);
+      }
+      /* writes arm the timer again when they add a ttl */
+      if (rearm)
+        mod_timer(&expire_timer, jiffies + SSTORE_WHEEL_TICK);
     }
-    timer_off = 0;
   }
   return 0;
 }
@@ -240,22 +1129,34 @@ sstore_cleanup(void)
 {
   int i;
 
-  /* Release the major number */
-  unregister_chrdev_region((sstore_dev_number), NUM_MINOR_DEVICES);
+  /* remove the debugfs entries before the devices go away */
+  if (sstore_debugfs) {
+    for (i=0; i<NUM_MINOR_DEVICES; i++) {
+      if (sstore_devp[i]->debugfs_entry)
+        debugfs_remove(sstore_devp[i]->debugfs_entry);
+    }
+    debugfs_remove(sstore_debugfs);
+  }
+
+  /* the thread sweeps the devices, stop it before they go away */
+  sstore_stop_clear_thread();
+
+  /* the last group reaches the log before the data is freed */
+  sstore_wal_close();
+
+  /* Release the major number */
+  unregister_chrdev_region((sstore_dev_number), NUM_MINOR_DEVICES);
 
   /* Release I/O region */
   for (i=0; i<NUM_MINOR_DEVICES; i++) {
     device_destroy (sstore_class, MKDEV(MAJOR(sstore_dev_number), i));
     /*release_region(addrports[i], 2); */
     cdev_del(&sstore_devp[i]->cdev);
-    kfree(sstore_devp[i]);
   }
+  sstore_free_devices(NUM_MINOR_DEVICES);
   /* Destroy sstore_class */
   class_destroy(sstore_class);
 
-  kthread_stop(clear_thread_ptr);
-  del_timer_sync(&clear_timer);
-
   
   /* clean all /proc entries */
   remove_proc_entry("data", sstore_proc);
@@ -265,6 +1166,39 @@ sstore_cleanup(void)
   return;
 }
 
+/*
+ * Allocate the blob array and buffers of a device, called under
+ * sstore_mutex or before the device is visible
+ */
+static int
+sstore_alloc_data(struct sstore_dev *dev)
+{
+  int i;
+
+  /* Allocate memory for an array of pointers to the blobs */
+  dev->data = kzalloc(max_num_blobs * sizeof(struct blob *), GFP_KERNEL);
+  dev->scratch = kmalloc(max_blob_size, GFP_KERNEL);
+  if (dedup) {
+    dev->dedup_hash = kmalloc(SSTORE_DEDUP_HASH_SIZE *
+                              sizeof (struct hlist_head), GFP_KERNEL);
+    if (dev->dedup_hash) {
+      for (i = 0; i < SSTORE_DEDUP_HASH_SIZE; i++)
+        INIT_HLIST_HEAD(&dev->dedup_hash[i]);
+    }
+  }
+  if (!dev->data || !dev->scratch || (dedup && !dev->dedup_hash)) {
+    printk(KERN_DEBUG "sstore: Couldn't allocate memory for the sstore blobs\n");
+    kfree(dev->data);
+    kfree(dev->scratch);
+    kfree(dev->dedup_hash);
+    dev->data = NULL;
+    dev->scratch = NULL;
+    dev->dedup_hash = NULL;
+    return -ENOMEM;
+  }
+  return 0;
+}
+
 /*
  * Open sstore
  * if this is the first time to open the device, allocate 
@@ -275,6 +1209,7 @@ sstore_open(struct inode *inode, struct file *file)
 {
 
   struct sstore_dev *dev; /* device information */
+  struct sstore_file *sf; /* per-file information */
 
   // Only root is allowed
   if (!capable(CAP_SYS_ADMIN))
@@ -283,46 +1218,282 @@ sstore_open(struct inode *inode, struct file *file)
   printk(KERN_DEBUG "sstore: SStore device opened\n"); 
 
   dev = container_of(inode->i_cdev, struct sstore_dev, cdev);
-  file->private_data = dev; /* to be used by other methods */
+
+  sf = kmalloc(sizeof (struct sstore_file), GFP_KERNEL);
+  if (!sf) {
+    sstore_alloc_failed(dev);
+    return -ENOMEM;
+  }
+  sf->dev = dev;
+  mutex_init(&sf->ring_mutex);
+  sf->ring = NULL;
+  file->private_data = sf; /* to be used by other methods */
+
+  /* the refcount only moves under the mutex, so a first open can't
+     overlap with the teardown of the last close */
+  sstore_lock(dev);
 
   /* check if this is the first time to open the device*/
   if (atomic_dec_and_test(&dev->refcount)) {
     printk(KERN_DEBUG "sstore: first device open, init memory ...\n"); 
- 	 
-    mutex_lock(&dev->sstore_mutex);
 
-    /* Allocate memory for an array of pointers to the blobs */
-    dev->data = kzalloc(max_num_blobs * sizeof(struct blob *), GFP_KERNEL);
-    if (!dev->data) {
-      printk(KERN_DEBUG "sstore: Couldn't allocate memory for the sstore blobs\n");
+    /* durable devices keep their data from load to unload */
+    if (!dev->data && sstore_alloc_data(dev)) {
+      atomic_inc(&dev->refcount);
+      sstore_unlock(dev);
+      sstore_alloc_failed(dev);
+      kfree(sf);
       return -ENOMEM;
     }
-    mutex_unlock(&dev->sstore_mutex);
   } 
+  sstore_unlock(dev);
 
   // Do we need to reset anything?
 
   return 0;
 }
 
-/* clear all data */
+/* allocate a queue of roundup_pow_of_two(queue_depth) messages */
+static struct sstore_queue *
+sstore_queue_alloc(void)
+{
+  struct sstore_queue *q;
+  unsigned long i, depth = roundup_pow_of_two(queue_depth);
+
+  q = kzalloc(sizeof (struct sstore_queue), GFP_KERNEL);
+  if (!q)
+    return NULL;
+
+  q->slots = kmalloc(depth * sizeof (struct sstore_queue_slot), GFP_KERNEL);
+  q->buffers = vmalloc(depth * max_blob_size);
+  if (!q->slots || !q->buffers) {
+    kfree(q->slots);
+    if (q->buffers)
+      vfree(q->buffers);
+    kfree(q);
+    return NULL;
+  }
+
+  for (i = 0; i < depth; i++) {
+    q->slots[i].seq = i;
+    q->slots[i].size = 0;
+    q->slots[i].data = q->buffers + i * max_blob_size;
+  }
+  q->mask = depth - 1;
+  init_waitqueue_head(&q->not_empty);
+  init_waitqueue_head(&q->not_full);
+  return q;
+}
+
+static void
+sstore_queue_free(struct sstore_queue *q)
+{
+  vfree(q->buffers);
+  kfree(q->slots);
+  kfree(q);
+}
+
+/* the slot at the tail is free for the next producer */
+static int
+sstore_queue_can_enqueue(struct sstore_queue *q)
+{
+  unsigned long pos = q->tail;
+
+  return (long) (q->slots[pos & q->mask].seq - pos) >= 0;
+}
+
+/* the slot at the head holds a message */
+static int
+sstore_queue_can_dequeue(struct sstore_queue *q)
+{
+  unsigned long pos = q->head;
+
+  return (long) (q->slots[pos & q->mask].seq - (pos + 1)) >= 0;
+}
+
+/*
+ * Claim the next position of 'cursor' (head or tail) whose slot sequence
+ * is 'pos + offset', sleeping on 'wq' while the ring is full/empty
+ * A consumer passes the 'room' of its buffer, a message that does not fit
+ * is left in the queue, producers pass -1.
+ * Returns the claimed slot, or an ERR_PTR.
+ */
+static struct sstore_queue_slot *
+sstore_queue_claim(struct sstore_queue *q, unsigned long *cursor,
+                   unsigned long offset, wait_queue_head_t *wq,
+                   int (*ready)(struct sstore_queue *), int nonblock,
+                   int room, unsigned long *claimed)
+{
+  struct sstore_queue_slot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = *cursor;
+  for (;;) {
+    slot = &q->slots[pos & q->mask];
+    seq = slot->seq;
+    smp_rmb();
+    diff = (long) (seq - (pos + offset));
+
+    if (diff == 0) {
+      /* the message can't change while the head is still at pos, so the
+         size checked here is the one of the slot the cmpxchg claims */
+      if (room >= 0 && slot->size > room)
+        return ERR_PTR(-ENOSPC);
+      if (cmpxchg(cursor, pos, pos + 1) == pos)
+        break;
+    } else if (diff < 0) {
+      /* full for producers, empty for consumers */
+      if (nonblock)
+        return ERR_PTR(-EAGAIN);
+      if (wait_event_interruptible(*wq, ready(q)))
+        return ERR_PTR(-ERESTARTSYS);
+    }
+    pos = *cursor;
+  }
+
+  *claimed = pos;
+  return slot;
+}
+
+/* publish a slot to the other side and wake it if it sleeps */
+static void
+sstore_queue_publish(struct sstore_queue_slot *slot, unsigned long seq,
+                     wait_queue_head_t *wq)
+{
+  /* the slot contents must be visible before the new sequence */
+  smp_mb();
+  slot->seq = seq;
+
+  /* pairs with the barrier in wait_event, avoids lost wake ups */
+  smp_mb();
+  if (waitqueue_active(wq))
+    wake_up_interruptible(wq);
+}
+
+/* write in queue mode, enqueue one message, the index is ignored */
+static ssize_t
+sstore_queue_write(struct sstore_queue *q, struct data_buffer *k_buf,
+                   int nonblock)
+{
+  struct sstore_queue_slot *slot;
+  unsigned long pos;
+  int faulted;
+
+  if (k_buf->size < 0 || k_buf->size > max_blob_size)
+    return -EINVAL;
+
+  slot = sstore_queue_claim(q, &q->tail, 0, &q->not_full,
+                            sstore_queue_can_enqueue, nonblock, -1, &pos);
+  if (IS_ERR(slot))
+    return PTR_ERR(slot);
+
+  /* the position is ours, a fault still has to publish the slot so the
+     consumers can move past it */
+  faulted = copy_from_user(slot->data, k_buf->data, k_buf->size) != 0;
+  slot->size = faulted ? -1 : k_buf->size;
+  sstore_queue_publish(slot, pos + 1, &q->not_empty);
+
+  return faulted ? -EFAULT : k_buf->size;
+}
+
+/* read in queue mode, dequeue one message, blocks while empty
+   A message larger than the buffer fails with ENOSPC and stays queued. */
+static ssize_t
+sstore_queue_read(struct sstore_queue *q, struct data_buffer *k_buf,
+                  int nonblock)
+{
+  struct sstore_queue_slot *slot;
+  unsigned long pos;
+  int size, faulted;
+
+  if (k_buf->size <= 0)
+    return -EINVAL;
+
+  /* skip messages whose producer faulted */
+  do {
+    slot = sstore_queue_claim(q, &q->head, 1, &q->not_empty,
+                              sstore_queue_can_dequeue, nonblock,
+                              k_buf->size, &pos);
+    if (IS_ERR(slot))
+      return PTR_ERR(slot);
+
+    size = slot->size;
+    faulted = 0;
+    if (size >= 0)
+      faulted = copy_to_user(k_buf->data, slot->data, size) != 0;
+    sstore_queue_publish(slot, pos + q->mask + 1, &q->not_full);
+  } while (size < 0);
+
+  return faulted ? -EFAULT : size;
+}
+
+/* switch the device to queue mode until the last user closes it */
+static int
+sstore_queue_enable(struct sstore_dev *dev)
+{
+  struct sstore_queue *q;
+  int retval = 0;
+
+  sstore_lock(dev);
+  if (!dev->queue) {
+    q = sstore_queue_alloc();
+    if (q) {
+      /* the ring must be initialized before readers/writers see it */
+      smp_wmb();
+      dev->queue = q;
+      printk(KERN_DEBUG "sstore: %s in queue mode, %lu slots\n",
+             dev->name, q->mask + 1);
+    } else {
+      sstore_alloc_failed(dev);
+      retval = -ENOMEM;
+    }
+  }
+  sstore_unlock(dev);
+
+  return retval;
+}
+
+/* back to store mode, called under sstore_mutex */
+static void
+sstore_queue_disable(struct sstore_dev *dev)
+{
+  if (dev->queue) {
+    sstore_queue_free(dev->queue);
+    dev->queue = NULL;
+  }
+}
+
+/* clear all data, called under sstore_mutex */
 
 void clear_data(struct sstore_dev *dev) {
   int i;
   struct blob *blobp;
   
-  mutex_lock(&dev->sstore_mutex);
   for(i = 0; i < max_num_blobs; i++) {
     blobp = dev->data[i];
     if (blobp) {
-      kfree(blobp->data);
-      kfree(blobp);
+      sstore_blob_free(dev, blobp);
       dev->data[i] = NULL;
     }    
 
   }
-  mutex_unlock(&dev->sstore_mutex);
-
+  dev->index = RB_ROOT;
+  for (i = 0; i < SSTORE_WHEEL_SIZE; i++)
+    INIT_LIST_HEAD(&dev->wheel[i]);
+  dev->nexpiring = 0;
+  sstore_changelog_add(dev, SSTORE_CHANGE_CLEAR, -1, 0);
+
+  /* back to store mode */
+  sstore_queue_disable(dev);
+
+  /* the next first open allocates them again */
+  kfree(dev->data);
+  kfree(dev->scratch);
+  kfree(dev->dedup_hash);
+  dev->data = NULL;
+  dev->scratch = NULL;
+  dev->dedup_hash = NULL;
 }
 
 /*
@@ -331,58 +1502,53 @@ void clear_data(struct sstore_dev *dev) {
 int
 sstore_release(struct inode *inode, struct file *file)
 {
-  struct sstore_dev *dev = file->private_data;
+  struct sstore_file *sf = file->private_data;
+  struct sstore_dev *dev = sf->dev;
 
   printk(KERN_DEBUG "sstore: SStore device released\n"); 
 
+  /* the rings can't be mapped anymore, the mappings hold the file */
+  if (sf->ring) {
+    vfree(sf->ring->hdr);
+    kfree(sf->ring);
+  }
+  kfree(sf);
+
+  /* the last close and its teardown are one critical section, an open
+     either comes before it or finds the device cleared */
+  sstore_lock(dev);
   atomic_inc(&dev->refcount);
   /* if there's is no more open devices, clear data */
   if(atomic_read(&dev->refcount) == 1) {
-    printk(KERN_DEBUG "sstore: no more opened sstores, clearing data ...\n"); 
-    clear_data(dev);
+    if (sstore_wal) {
+      /* the log holds the data until the module is unloaded */
+      printk(KERN_DEBUG "sstore: no more opened sstores, keeping durable data\n");
+      sstore_queue_disable(dev);
+    } else {
+      printk(KERN_DEBUG "sstore: no more opened sstores, clearing data ...\n"); 
+      clear_data(dev);
+    }
   }
+  sstore_unlock(dev);
   return 0;
 }
 
 /*
- * Read from a sstore at given index
- * If the read index is past end-of-store then block until
- * a new record is written at its index.
+ * Fetch the blob at k_buf->index into the user buffer
+ * If there is no blob at the index, block until a new record is written
+ * at it, or fail with EAGAIN if 'nonblock' is set.
+ * Returns the number of bytes copied.
  */
-ssize_t
-sstore_read(struct file *file, char __user *u_buf,
-          size_t count, loff_t *ppos)
+static ssize_t
+sstore_fetch(struct sstore_dev *dev, struct data_buffer *k_buf, int nonblock)
 {
-  struct sstore_dev *dev = file->private_data;
-  struct data_buffer *k_buf; /* has the index, size, 
-			    and data to be written */
-  ssize_t bytes_read = 0; /* Hmm, what about count arg */
   struct blob *blob;
-  
-  printk(KERN_DEBUG "sstore: read\t"); 
-
-  k_buf = kmalloc (sizeof (struct data_buffer), GFP_KERNEL);
-  if (!k_buf) {
-    printk("sstore: Bad kmalloc\n");
-    return -ENOMEM;
-  }
-  
-  if(copy_from_user(k_buf, u_buf, sizeof (struct data_buffer))) {
-    printk("sstore: Copy from user\n");
-    kfree(k_buf);
-    return -EFAULT;
-  }
-
-#ifdef DEBUG
-  printk("index: %d\t", k_buf->index);
-  printk("size : %d\n", k_buf->size);
-#endif
+  ktime_t start = ktime_get(), sleep_start;
 
   /* check if index is valid */
   if(k_buf-> index < 0
-    || k_buf->index > max_num_blobs) {
+    || k_buf->index >= max_num_blobs) {
     printk(KERN_INFO "sstore: Invalid \"index\" in the read request\n");
-    kfree(k_buf);
     return -EINVAL;
   }
 
@@ -390,36 +1556,40 @@ sstore_read(struct file *file, char __user *u_buf,
   if(k_buf->size <= 0
     || k_buf->size > max_blob_size) {
     printk(KERN_DEBUG "sstore: Invalid \"size\" in the read request\n");
-    kfree(k_buf);
     return -EINVAL;
   }
 #ifdef DEBUG
   printk(KERN_DEBUG "sstore: mutex read\n");
 #endif
 
-  mutex_lock(&dev->sstore_mutex);
-  blob = dev->data[k_buf->index];
+  sstore_lock(dev);
+  blob = sstore_blob_lookup(dev, k_buf->index);
+
+  /* a remove may beat us to the mutex after the wake up, so sleep again */
+  while (!blob) {
+    sstore_unlock(dev);
+    if (nonblock)
+      return -EAGAIN;
 
-  if (!blob) {
     printk(KERN_INFO "sstore: Invalid Index, sleeping ...\n");
     /* sleep & wait for data */
-    mutex_unlock(&dev->sstore_mutex);
+    sleep_start = ktime_get();
     wait_event_interruptible(dev->wq, dev->data[k_buf->index]);
+    sstore_hist_add(dev, SSTORE_HIST_BLOCKED, sleep_start, ktime_get());
     
-	/* check if the reader woke up by signal, then free the buffer and die */
+	/* check if the reader woke up by signal, then die */
 	if (signal_pending(current)) {
 		printk(KERN_ALERT "sstore: pid %u got signal.\n", (unsigned) current->pid);
-		kfree(k_buf);
 		return -EINTR;
 	}
 	  
-	mutex_lock(&dev->sstore_mutex);
-    blob = dev->data[k_buf->index];
+	sstore_lock(dev);
+    blob = sstore_blob_lookup(dev, k_buf->index);
   } 
   
 
 #ifdef DEBUG
-  printk("sstore: User Data: %s\n", blob->data);
+  printk("sstore: User Data: %.*s\n", blob->size, blob->data);
 #endif
 
 
@@ -429,133 +1599,733 @@ sstore_read(struct file *file, char __user *u_buf,
   if (k_buf->size > blob->size) {
     printk(KERN_ALERT "sstore: requested read size is larger than the existing\n");
     k_buf->size = blob->size;
-    bytes_read = blob->size;
   } 
 
   /* copy the data to user space */
   if(copy_to_user(k_buf->data, blob->data, k_buf->size)) {
     printk("sstore: Copy to user\n");
-    mutex_unlock(&dev->sstore_mutex);
-    kfree(k_buf);
+    sstore_unlock(dev);
     return -EFAULT;
   }
   /* Increment number of read operations */
   dev->nreads++;
 
-  mutex_unlock(&dev->sstore_mutex);
+  sstore_unlock(dev);
 
-  kfree(k_buf);
+  sstore_hist_add(dev, SSTORE_HIST_READ, start, ktime_get());
 
-  return bytes_read;
+  return k_buf->size;
 }
 
 /*
- * Write to a sstore at a given index
+ * Read from a sstore at given index
+ * If the read index is past end-of-store then block until
+ * a new record is written at its index.
+ * Returns the number of bytes read.
  */
 ssize_t
-sstore_write(struct file *file, const char __user *u_buf,
-           size_t count, loff_t *ppos)
+sstore_read(struct file *file, char __user *u_buf,
+          size_t count, loff_t *ppos)
 {
-  struct sstore_dev *dev = file->private_data;
-  struct data_buffer *k_buf; /* has the index, size, 
-			    and data to be written */
-  ssize_t bytes_written = 0;
+  struct sstore_file *sf = file->private_data;
+  struct sstore_dev *dev = sf->dev;
+  struct data_buffer k_buf; /* has the index, size, 
+			    and where to copy the data */
+  struct sstore_queue *q = dev->queue;
 
-  struct blob *blob;
+  if(copy_from_user(&k_buf, u_buf, sizeof (struct data_buffer))) {
+    printk("sstore: Copy from user\n");
+    return -EFAULT;
+  }
 
-  printk(KERN_DEBUG "sstore: Write\t"); 
+  /* queue mode skips the logging and instrumentation, it is meant to
+     move millions of messages per second */
+  if (q) {
+    smp_rmb();
+    return sstore_queue_read(q, &k_buf, file->f_flags & O_NONBLOCK);
+  }
+
+  printk(KERN_DEBUG "sstore: read\t"); 
+
+#ifdef DEBUG
+  printk("index: %d\t", k_buf.index);
+  printk("size : %d\n", k_buf.size);
+#endif
+
+  return sstore_fetch(dev, &k_buf, file->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Store a private copy of the user data at k_buf->index
+ * Overwriting an existing blob is the fast path: if the new data fits in the
+ * blob buffer it is updated in place under the device mutex, so readers (who
+ * copy out under the same mutex) never observe torn data. The user data is
+ * staged through the per-device scratch buffer first, so a faulting copy
+ * leaves the old contents intact. Otherwise a new blob is allocated outside
+ * the mutex, swapped in, and the old one is freed.
+ */
+static int
+sstore_write_blob(struct sstore_dev *dev, struct data_buffer *k_buf,
+                  unsigned int ttl_ms, u64 *lsn)
+{
+  struct blob *blob, *old;
+
+#ifdef DEBUG
+  printk(KERN_DEBUG "sstore: Write mutex\n");
+#endif
+  sstore_lock(dev);
+  blob = dev->data[k_buf->index];
+
+  if (blob && k_buf->size <= blob->capacity) {
+    /* overwrite in place, no allocation */
+    if (copy_from_user(dev->scratch, k_buf->data, k_buf->size)) {
+      printk(KERN_DEBUG "sstore: Problem copying from user space\n");
+      sstore_unlock(dev);
+      return -EFAULT;
+    }
+    memcpy(blob->data, dev->scratch, k_buf->size);
+    blob->size = k_buf->size;
+    sstore_blob_set_ttl(dev, blob, ttl_ms);
+    dev->nwrites++;
+    sstore_changelog_add(dev, SSTORE_CHANGE_WRITE, k_buf->index, k_buf->size);
+    *lsn = sstore_wal_append(dev, SSTORE_CHANGE_WRITE, k_buf->index,
+                             blob->data, k_buf->size, ttl_ms);
+    sstore_unlock(dev);
+
+    spin_lock(&dev->stats_lock);
+    dev->stats.overwrites_inplace++;
+    spin_unlock(&dev->stats_lock);
+    return 0;
+  }
+  sstore_unlock(dev);
 
-  k_buf = kmalloc (sizeof (struct data_buffer), GFP_KERNEL);
-  if (!k_buf) {
+  /* allocate memory for the blob */
+  blob = sstore_blob_alloc(k_buf->size);
+  if (!blob) {
     printk("sstore: Bad kmalloc\n");
+    sstore_alloc_failed(dev);
     return -ENOMEM;
   }
-  
-  /* copy the request from user space, this is not the actual data
-   * to be written but just the index, size, and a pointer to the 
-   * data, data copying will occur later after checking the index
-   * and size 
-   */
-  if(copy_from_user(k_buf, u_buf, sizeof (struct data_buffer))) {
+
+  /* copy the actual data to be written from user space */
+  if(copy_from_user(blob->data, k_buf->data, k_buf->size)) {
     printk(KERN_DEBUG "sstore: Problem copying from user space\n");
-    kfree(k_buf);
+    sstore_blob_free(dev, blob);
     return -EFAULT;
   }
+  printk(KERN_DEBUG "sstore: Finished copying from user space\n");
+
+  /* acquire the mutex, swap the blob pointer in the dev structure,
+     no reader can reference the old blob once we drop the mutex */
+  sstore_lock(dev);
+  old = dev->data[k_buf->index];
+  dev->data[k_buf->index] = blob;
+  if (old) {
+    blob->index = k_buf->index;
+    rb_replace_node(&old->node, &blob->node, &dev->index);
+    sstore_blob_set_ttl(dev, old, 0);
+  } else {
+    sstore_index_insert(dev, blob, k_buf->index);
+  }
+  sstore_blob_set_ttl(dev, blob, ttl_ms);
+
+  /* Increment number of write operations for statistics */
+  dev->nwrites++;
+  sstore_changelog_add(dev, SSTORE_CHANGE_WRITE, k_buf->index, k_buf->size);
+  *lsn = sstore_wal_append(dev, SSTORE_CHANGE_WRITE, k_buf->index,
+                           blob->data, k_buf->size, ttl_ms);
+  sstore_unlock(dev);
+
+  if (old) {
+    sstore_blob_free(dev, old);
+    spin_lock(&dev->stats_lock);
+    dev->stats.overwrites_replaced++;
+    spin_unlock(&dev->stats_lock);
+  }
+  return 0;
+}
 
-#ifdef DEBUG
-  printk("index: %d\t", k_buf->index);
-  printk("size : %d\n", k_buf->size);
-#endif
+/*
+ * Store the user data at k_buf->index in dedup mode
+ * The data is hashed and looked up in the device payload table, slots with
+ * the same content share one refcounted payload that is never modified.
+ * Writing a slot drops its reference to the old payload and takes one on
+ * the new content (copy-on-write), all under the device mutex.
+ */
+static int
+sstore_write_dedup(struct sstore_dev *dev, struct data_buffer *k_buf,
+                   unsigned int ttl_ms, u64 *lsn)
+{
+  struct sstore_payload *payload, *old = NULL;
+  struct blob *blob;
+
+  sstore_lock(dev);
+
+  if (copy_from_user(dev->scratch, k_buf->data, k_buf->size)) {
+    printk(KERN_DEBUG "sstore: Problem copying from user space\n");
+    sstore_unlock(dev);
+    return -EFAULT;
+  }
+
+  blob = dev->data[k_buf->index];
+  if (!blob) {
+    blob = kzalloc(sizeof (struct blob), GFP_KERNEL);
+    if (!blob) {
+      sstore_unlock(dev);
+      printk("sstore: Bad kmalloc\n");
+      sstore_alloc_failed(dev);
+      return -ENOMEM;
+    }
+    INIT_LIST_HEAD(&blob->expiry);
+  } else {
+    old = blob->payload;
+  }
+
+  payload = sstore_dedup_get(dev, dev->scratch, k_buf->size);
+  if (!payload) {
+    if (!dev->data[k_buf->index])
+      kfree(blob);
+    sstore_unlock(dev);
+    printk("sstore: Bad kmalloc\n");
+    sstore_alloc_failed(dev);
+    return -ENOMEM;
+  }
+
+  blob->payload = payload;
+  blob->data = payload->data;
+  blob->size = payload->size;
+  blob->capacity = 0;
+  if (!dev->data[k_buf->index]) {
+    dev->data[k_buf->index] = blob;
+    sstore_index_insert(dev, blob, k_buf->index);
+  }
+  sstore_blob_set_ttl(dev, blob, ttl_ms);
+  if (old)
+    sstore_dedup_put(dev, old);
+
+  /* Increment number of write operations for statistics */
+  dev->nwrites++;
+  sstore_changelog_add(dev, SSTORE_CHANGE_WRITE, k_buf->index, k_buf->size);
+  *lsn = sstore_wal_append(dev, SSTORE_CHANGE_WRITE, k_buf->index,
+                           payload->data, k_buf->size, ttl_ms);
+  sstore_unlock(dev);
+
+  return 0;
+}
+
+/*
+ * Store the user data described by k_buf at k_buf->index, with an
+ * optional time-to-live, and wake the readers waiting for it
+ * With the write-ahead log on, returns once the write is in the log, or
+ * right after appending it if 'wait_lsn' is set: the caller then waits
+ * for *wait_lsn itself, so a batch of writes needs a single commit.
+ * Returns the number of bytes written.
+ */
+static ssize_t
+sstore_store(struct sstore_dev *dev, struct data_buffer *k_buf,
+             unsigned int ttl_ms, u64 *wait_lsn)
+{
+  int retval;
+  u64 lsn = 0;
+  ktime_t start = ktime_get();
 
   /* check if index value is valid */
   if (k_buf->index < 0 
-      || k_buf->index > max_num_blobs) {
+      || k_buf->index >= max_num_blobs) {
     printk(KERN_INFO "sstore: Invalid \"index\" in the write request.\n"); 
-    kfree(k_buf);
     return -EINVAL;
   }
 
   if (k_buf->size < 0 
      || k_buf->size > max_blob_size) {
     printk(KERN_DEBUG "sstore: Invalid \"size\" in the write request.\n");
-    kfree(k_buf);
     return -EINVAL;
   } 
 
-  /* allocate memory for the blob */	
-  blob = kmalloc(sizeof (struct blob), GFP_KERNEL);
-  if (blob) {
-	/* allocate memory for the blob data itself */
-    blob->data = kmalloc(k_buf->size, GFP_KERNEL);
-    if (!blob->data) {
-      printk("sstore: Bad kmalloc\n");
-      kfree(k_buf);
-      return -ENOMEM;
-    }
+  retval = sstore_wal_reserve(k_buf->size);
+  if (retval)
+    return retval;
+
+  if (dedup)
+    retval = sstore_write_dedup(dev, k_buf, ttl_ms, &lsn);
+  else
+    retval = sstore_write_blob(dev, k_buf, ttl_ms, &lsn);
+  if (retval) {
+    sstore_wal_cancel(k_buf->size);
+    return retval;
+  }
+
+  /* wake all sleeping readers on this device */
+  sstore_wake_readers(dev);
+
+  /* readers may see the data before it is durable, the writer only
+     returns once it is */
+  if (wait_lsn) {
+    *wait_lsn = lsn;
+  } else {
+    retval = sstore_wal_wait(lsn);
+    if (retval)
+      return retval;
+  }
+
+  sstore_hist_add(dev, SSTORE_HIST_WRITE, start, ktime_get());
+
+  return k_buf->size;
+}
+
+/*
+ * Write to a sstore at a given index
+ * A struct data_buffer_ttl (count == sizeof (struct data_buffer_ttl))
+ * also sets the blob time-to-live.
+ */
+ssize_t
+sstore_write(struct file *file, const char __user *u_buf,
+           size_t count, loff_t *ppos)
+{
+  struct sstore_file *sf = file->private_data;
+  struct sstore_dev *dev = sf->dev;
+  struct data_buffer_ttl k_req;
+  struct data_buffer k_buf; /* has the index, size, 
+			    and data to be written */
+  unsigned int ttl_ms = 0;
+  struct sstore_queue *q = dev->queue;
 
-	/* copy the actual data to be written from user space */
-    if(copy_from_user(blob->data, k_buf->data, k_buf->size)) {
+  /* copy the request from user space, this is not the actual data
+   * to be written but just the index, size, and a pointer to the 
+   * data, data copying will occur later after checking the index
+   * and size 
+   */
+  if (count >= sizeof (struct data_buffer_ttl)) {
+    if(copy_from_user(&k_req, u_buf, sizeof (struct data_buffer_ttl))) {
       printk(KERN_DEBUG "sstore: Problem copying from user space\n");
-      kfree(k_buf);
-      kfree(blob);
       return -EFAULT;
     }
-    printk(KERN_DEBUG "sstore: Finished copying from user space\n");
+    k_buf = k_req.buf;
+    ttl_ms = k_req.ttl_ms;
+  } else if(copy_from_user(&k_buf, u_buf, sizeof (struct data_buffer))) {
+    printk(KERN_DEBUG "sstore: Problem copying from user space\n");
+    return -EFAULT;
+  }
 
-    /* set the blob size to the size in the write request */
-	blob->size = k_buf->size;
+  if (q) {
+    smp_rmb();
+    return sstore_queue_write(q, &k_buf, file->f_flags & O_NONBLOCK);
+  }
 
-#ifdef DEBUG
-  printk(KERN_DEBUG "sstore: Write mutex\n");
-#endif
-	/* acquire the mutex, set the blob pointer in the dev structure */
-    mutex_lock(&dev->sstore_mutex);
-    dev->data[k_buf->index] = blob;
-    bytes_written = k_buf->size;
+  printk(KERN_DEBUG "sstore: Write\t"); 
 
 #ifdef DEBUG
-  printk("sstore: User Data: %s\n", blob->data);
+  printk("index: %d\t", k_buf.index);
+  printk("size : %d\n", k_buf.size);
 #endif
-    /* Increment number of write operations for statistics */
-    dev->nwrites++;
 
-    mutex_unlock(&dev->sstore_mutex);
-	  
-	/* wake all sleeping readers on this device */
-    wake_up_interruptible(&dev->wq);
+  return sstore_store(dev, &k_buf, ttl_ms, NULL);
+}
+
+/*
+ * Range scan, SSTORE_IOCSCAN
+ * Copy the blobs with index in [max(start, cursor), end) to the user buffer
+ * in index order, each one as a struct sstore_scan_entry followed by its data
+ * padded to SSTORE_SCAN_ALIGN. The whole call runs under the device mutex so
+ * it sees a consistent view of the store. When the buffer fills up, cursor
+ * is left at the first index not returned so the caller can resume from it,
+ * it is set to end once the range is exhausted.
+ * Returns the number of entries copied.
+ */
+static int
+sstore_scan(struct sstore_dev *dev, struct sstore_scan __user *u_scan)
+{
+  struct sstore_scan scan;
+  struct sstore_scan_entry entry;
+  struct blob *blob;
+  struct rb_node *node;
+  int used = 0, len, nentries = 0, retval = 0;
 
+  if (copy_from_user(&scan, u_scan, sizeof (struct sstore_scan)))
+    return -EFAULT;
+
+  if (scan.start < 0 || scan.end > max_num_blobs || scan.start > scan.end
+      || scan.buf_size < 0)
+    return -EINVAL;
+  if (scan.cursor < scan.start)
+    scan.cursor = scan.start;
+
+  sstore_lock(dev);
+  blob = dev->data ? sstore_index_lookup(dev, scan.cursor) : NULL;
+  while (blob && blob->index < scan.end) {
+    /* expired, left for the sweep so the walk stays valid */
+    if (sstore_blob_expired(blob)) {
+      node = rb_next(&blob->node);
+      blob = node ? rb_entry(node, struct blob, node) : NULL;
+      continue;
+    }
+
+    len = SSTORE_SCAN_ENTRY_LEN(blob->size);
+    if (used + len > scan.buf_size) {
+      /* not even one entry fits, the caller must grow the buffer */
+      if (!nentries)
+        retval = -ENOSPC;
+      break;
+    }
+
+    entry.index = blob->index;
+    entry.size = blob->size;
+    if (copy_to_user(scan.buf + used, &entry, sizeof (entry))
+        || copy_to_user(scan.buf + used + sizeof (entry),
+                        blob->data, blob->size)) {
+      retval = -EFAULT;
+      break;
+    }
+    used += len;
+    nentries++;
+
+    node = rb_next(&blob->node);
+    blob = node ? rb_entry(node, struct blob, node) : NULL;
+  }
+  dev->nreads += nentries;
+  sstore_unlock(dev);
+
+  if (retval)
+    return retval;
+
+  /* resume from the first blob that did not fit */
+  scan.cursor = (blob && blob->index < scan.end) ? blob->index : scan.end;
+  scan.nentries = nentries;
+  if (copy_to_user(u_scan, &scan, sizeof (struct sstore_scan)))
+    return -EFAULT;
+
+  return nentries;
+}
+
+/*
+ * Incremental change log read, SSTORE_IOCCHANGES
+ * Copy up to 'nrecords' records following 'cursor' (the last sequence the
+ * caller has seen) and advance the cursor past them. If records after the
+ * cursor have already been overwritten 'overflow' is set and the cursor
+ * jumps to the oldest record still in the log, the caller must rescan the
+ * store. Returns the number of records copied.
+ */
+static int
+sstore_changes(struct sstore_dev *dev, struct sstore_changes __user *u_req)
+{
+  struct sstore_changes req;
+  unsigned long long head, oldest, n;
+  int i, count, retval = 0;
+
+  if (!dev->changelog)
+    return -ENODEV;
+
+  if (copy_from_user(&req, u_req, sizeof (struct sstore_changes)))
+    return -EFAULT;
+  if (req.nrecords < 0)
+    return -EINVAL;
+
+  sstore_lock(dev);
+  head = dev->changelog_head;
+  n = dev->changelog_mask + 1;
+  oldest = head > n ? head - n + 1 : 1;
+
+  req.overflow = 0;
+  if (req.cursor + 1 < oldest) {
+    req.overflow = 1;
+    req.cursor = oldest - 1;
+  } else if (req.cursor > head) {
+    /* cursor from the future, nothing we can do but restart the caller */
+    req.overflow = 1;
+    req.cursor = head;
+  }
+
+  count = min_t(unsigned long long, head - req.cursor, req.nrecords);
+  for (i = 0; i < count; i++) {
+    if (copy_to_user(req.records + i,
+                     &dev->changes[(req.cursor + i) & dev->changelog_mask],
+                     sizeof (struct sstore_change))) {
+      retval = -EFAULT;
+      break;
+    }
+  }
+  sstore_unlock(dev);
+
+  if (retval)
+    return retval;
+
+  req.cursor += count;
+  req.nrecords = count;
+  if (copy_to_user(u_req, &req, sizeof (struct sstore_changes)))
+    return -EFAULT;
+
+  return count;
+}
+
+/*
+ * Map the change log read only, at offset SSTORE_MMAP_CHANGELOG, or the
+ * submission/completion rings of this file at offset SSTORE_MMAP_RING
+ */
+static int
+sstore_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct sstore_file *sf = file->private_data;
+  struct sstore_dev *dev = sf->dev;
+
+  switch (vma->vm_pgoff) {
+    case SSTORE_MMAP_CHANGELOG / PAGE_SIZE:
+      if (!dev->changelog)
+        return -EINVAL;
+      if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+      /* no mprotect(PROT_WRITE) later either */
+      vma->vm_flags &= ~VM_MAYWRITE;
+      return remap_vmalloc_range(vma, dev->changelog, 0);
+    case SSTORE_MMAP_RING / PAGE_SIZE:
+      if (!sf->ring)
+        return -EINVAL;
+      return remap_vmalloc_range(vma, sf->ring->hdr, 0);
+    default:
+      return -EINVAL;
+  }
+}
+
+/*
+ * Remove the blob at a given index
+ * Like sstore_store(), waits for the log unless 'wait_lsn' is set.
+ */
+static int
+sstore_remove(struct sstore_dev *dev, unsigned int index, u64 *wait_lsn)
+{
+  struct blob *blobp;
+  u64 lsn = 0;
+  int retval;
+  ktime_t start = ktime_get();
+
+  /* make sure the index is within the boundaris */
+  if (index >= max_num_blobs)
+    return -EINVAL;
+
+  retval = sstore_wal_reserve(0);
+  if (retval)
+    return retval;
+
+  /* readers copy out under the mutex, so the blob can be
+     freed as soon as it is unlinked */
+  sstore_lock(dev);
+  blobp = dev->data[index];
+  dev->data[index] = NULL;
+  if (blobp) {
+    rb_erase(&blobp->node, &dev->index);
+    sstore_blob_set_ttl(dev, blobp, 0);
+    sstore_blob_free(dev, blobp);
+    sstore_changelog_add(dev, SSTORE_CHANGE_REMOVE, index, 0);
+    lsn = sstore_wal_append(dev, SSTORE_CHANGE_REMOVE, index, NULL, 0, 0);
+  }
+  sstore_unlock(dev);
+
+  if (blobp) { /* valid blob */
+    printk(KERN_DEBUG "sstore: Freeing blob memory\n");
+  } else { /* blob @ index is not valid */
+    printk(KERN_INFO "sstore: Request to remove invalid entry\n");
+    sstore_wal_cancel(0);
+    return -ENOTTY;
+  }
+
+  if (wait_lsn) {
+    *wait_lsn = lsn;
+  } else {
+    retval = sstore_wal_wait(lsn);
+    if (retval)
+      return retval;
+  }
+
+  sstore_hist_add(dev, SSTORE_HIST_REMOVE, start, ktime_get());
+  return 0;
+}
+
+/*
+ * Submission/completion rings, SSTORE_IOCRINGSETUP
+ * Allocate the rings of this file, the client maps them with mmap() at
+ * offset SSTORE_MMAP_RING and the size returned in params.
+ */
+static int
+sstore_ring_setup(struct sstore_file *sf,
+                  struct sstore_ring_params __user *u_params)
+{
+  struct sstore_ring_params params;
+  struct sstore_ring *ring;
+  struct sstore_ring_header *hdr;
+  unsigned int entries;
+  size_t size;
+
+  if (copy_from_user(&params, u_params, sizeof (struct sstore_ring_params)))
+    return -EFAULT;
+  if (!params.sq_entries || params.sq_entries > SSTORE_RING_MAX_ENTRIES)
+    return -EINVAL;
+
+  entries = roundup_pow_of_two(params.sq_entries);
+  size = PAGE_ALIGN(SSTORE_RING_CQ_OFF(entries)
+                    + 2 * entries * sizeof (struct sstore_cqe));
+
+  ring = kzalloc(sizeof (struct sstore_ring), GFP_KERNEL);
+  hdr = vmalloc_user(size);
+  if (!ring || !hdr) {
+    kfree(ring);
+    if (hdr)
+      vfree(hdr);
+    sstore_alloc_failed(sf->dev);
+    return -ENOMEM;
+  }
+
+  /* the completion ring is twice as large, so a full submission ring
+     always fits in it */
+  hdr->sq_entries = entries;
+  hdr->cq_entries = 2 * entries;
+  hdr->sq_off = SSTORE_RING_SQ_OFF;
+  hdr->cq_off = SSTORE_RING_CQ_OFF(entries);
+  ring->hdr = hdr;
+  ring->sqes = (struct sstore_sqe *) ((char *) hdr + hdr->sq_off);
+  ring->cqes = (struct sstore_cqe *) ((char *) hdr + hdr->cq_off);
+  ring->sq_mask = hdr->sq_entries - 1;
+  ring->cq_mask = hdr->cq_entries - 1;
+
+  params.sq_entries = hdr->sq_entries;
+  params.cq_entries = hdr->cq_entries;
+  params.size = size;
+  if (copy_to_user(u_params, &params, sizeof (struct sstore_ring_params))) {
+    vfree(hdr);
+    kfree(ring);
+    return -EFAULT;
+  }
+
+  /* one pair of rings per file */
+  mutex_lock(&sf->ring_mutex);
+  if (sf->ring) {
+    mutex_unlock(&sf->ring_mutex);
+    vfree(hdr);
+    kfree(ring);
+    return -EBUSY;
+  }
+  sf->ring = ring;
+  mutex_unlock(&sf->ring_mutex);
+
+  return 0;
+}
+
+/* execute one submission, reads never block, writes and removes leave
+   the log record to wait for in *lsn */
+static int
+sstore_ring_exec(struct sstore_dev *dev, struct sstore_sqe *sqe, u64 *lsn)
+{
+  struct data_buffer k_buf;
+  struct sstore_queue *q = dev->queue;
+
+  smp_rmb();
+  k_buf.index = sqe->index;
+  k_buf.size = sqe->size;
+  k_buf.data = (char __user *) (unsigned long) sqe->addr;
+
+  switch (sqe->op) {
+    case SSTORE_OP_NOP:
+      return 0;
+    case SSTORE_OP_WRITE:
+      if (q)
+        return sstore_queue_write(q, &k_buf, 1);
+      return sstore_store(dev, &k_buf, sqe->ttl_ms, lsn);
+    case SSTORE_OP_READ:
+      if (q)
+        return sstore_queue_read(q, &k_buf, 1);
+      return sstore_fetch(dev, &k_buf, 1);
+    case SSTORE_OP_REMOVE:
+      return sstore_remove(dev, sqe->index, lsn);
+    default:
+      return -EINVAL;
+  }
+}
+
+/*
+ * Doorbell, SSTORE_IOCRINGENTER
+ * Execute every submission the client queued since the last doorbell, in
+ * order, and post one completion for each. Submissions are left in the
+ * ring if the completion ring is full. The kernel keeps its own copy of
+ * the indices it owns, the mapped ones are only published to the client.
+ * With the write-ahead log on, the whole batch is appended first and
+ * waited for once, before the completions are published. If the log
+ * fails, every write and remove of the batch completes with EIO.
+ * Returns the number of submissions consumed.
+ */
+#define SSTORE_CQE_LOGGED          1   /* private until cq_tail moves */
+
+static int
+sstore_ring_enter(struct sstore_file *sf)
+{
+  struct sstore_ring *ring;
+  struct sstore_ring_header *hdr;
+  struct sstore_sqe sqe;
+  struct sstore_cqe *cqe;
+  unsigned int tail, cq_start, i, n = 0;
+  u64 lsn, last_lsn = 0;
+  int retval;
+
+  mutex_lock(&sf->ring_mutex);
+  ring = sf->ring;
+  if (!ring) {
+    mutex_unlock(&sf->ring_mutex);
+    return -EINVAL;
+  }
+  hdr = ring->hdr;
+
+  tail = ACCESS_ONCE(hdr->sq_tail);
+  /* read the submissions after the tail that published them */
+  smp_rmb();
+  /* the sizes in the header are the client's to scribble on too, bound
+     the batch by the ones set up in the kernel */
+  if (tail - ring->sq_head > ring->sq_mask + 1)
+    tail = ring->sq_head + ring->sq_mask + 1;
+
+  cq_start = ring->cq_tail;
+  while (ring->sq_head != tail) {
+    if (ring->cq_tail - ACCESS_ONCE(hdr->cq_head) > ring->cq_mask)
+      break;
+
+    /* the client can scribble on the ring, work on a copy */
+    sqe = ring->sqes[ring->sq_head & ring->sq_mask];
+    cqe = &ring->cqes[ring->cq_tail & ring->cq_mask];
+    cqe->user_data = sqe.user_data;
+    lsn = 0;
+    cqe->res = sstore_ring_exec(sf->dev, &sqe, &lsn);
+    cqe->flags = lsn ? SSTORE_CQE_LOGGED : 0;
+    if (lsn > last_lsn)
+      last_lsn = lsn;
+
+    ring->sq_head++;
+    ring->cq_tail++;
+    n++;
+  }
+
+  /* one group commit covers the whole batch */
+  retval = sstore_wal_wait(last_lsn);
+  for (i = cq_start; last_lsn && i != ring->cq_tail; i++) {
+    cqe = &ring->cqes[i & ring->cq_mask];
+    if (retval && (cqe->flags & SSTORE_CQE_LOGGED))
+      cqe->res = retval;
+    cqe->flags = 0;
   }
 
-  /* free the allocated kernel buffer */
-  kfree(k_buf);
+  /* completions must be visible before the new tail, and we are done
+     with the submission slots before the client may reuse them */
+  smp_mb();
+  hdr->sq_head = ring->sq_head;
+  hdr->cq_tail = ring->cq_tail;
+  mutex_unlock(&sf->ring_mutex);
 
-  return bytes_written;
+  return n;
 }
 
 /*
  * Ioctls 
- * The only supported operation is SSTORE_IOCREMOVE to remove
- * a blob from a given index
+ * SSTORE_IOCREMOVE removes a blob from a given index
+ * SSTORE_IOCSCAN copies the blobs in a range of indices, see sstore_scan()
+ * SSTORE_IOCQUEUE switches the device to FIFO queue mode
+ * SSTORE_IOCCHANGES reads the change log, see sstore_changes()
+ * SSTORE_IOCRINGSETUP and SSTORE_IOCRINGENTER drive the submission and
+ * completion rings, see sstore_ring_enter()
  */
 static int
 sstore_ioctl(struct inode *inode, struct file *file,
@@ -563,8 +2333,8 @@ sstore_ioctl(struct inode *inode, struct file *file,
 {
   int retval = 0;
   unsigned int index;
-  struct sstore_dev *dev = file->private_data;
-  struct blob* blobp;
+  struct sstore_file *sf = file->private_data;
+  struct sstore_dev *dev = sf->dev;
   
   /* extract the type and make sure we have correct cmd */
   if (_IOC_TYPE(cmd) != SSTORE_IOC_MAGIC) return -ENOTTY;
@@ -575,23 +2345,23 @@ sstore_ioctl(struct inode *inode, struct file *file,
     case SSTORE_IOCREMOVE:
       printk(KERN_DEBUG "sstore: Remove blob\n");
       retval = get_user(index, (unsigned int __user *) arg);
-      if (!retval) { /* success */
-        /* make sure the index is within the boundaris */
-        if (index < 0 || index > max_num_blobs)
-          return -EINVAL;
-
-        blobp = dev->data[index];
-        if (blobp) { /* valid blob */
-          kfree(blobp->data);
-          kfree(blobp);
-          printk(KERN_DEBUG "sstore: Freeing blob memory\n");
-          dev->data[index] = NULL;
-        } else { /* blob @ index is not valid */
-          printk(KERN_INFO "sstore: Request to remove invalid entry\n");
-          return -ENOTTY;
-        }
-      }
-      
+      if (!retval) /* success */
+        retval = sstore_remove(dev, index, NULL);
+      break;
+    case SSTORE_IOCSCAN:
+      retval = sstore_scan(dev, (struct sstore_scan __user *) arg);
+      break;
+    case SSTORE_IOCQUEUE:
+      retval = sstore_queue_enable(dev);
+      break;
+    case SSTORE_IOCCHANGES:
+      retval = sstore_changes(dev, (struct sstore_changes __user *) arg);
+      break;
+    case SSTORE_IOCRINGSETUP:
+      retval = sstore_ring_setup(sf, (struct sstore_ring_params __user *) arg);
+      break;
+    case SSTORE_IOCRINGENTER:
+      retval = sstore_ring_enter(sf);
       break;
     default:
       return -ENOTTY;
@@ -620,7 +2390,7 @@ int sstore_read_procmem(char *buf, char **start, off_t offset,
     len += sprintf(buf+len, "\nDevice %i:", i);
 
     /* acquire the mutext before doing anything */
-	mutex_lock(&sstore_devp[i]->sstore_mutex);
+	sstore_lock(sstore_devp[i]);
 	  
 	/* if the store has data */
     if (sstore_devp[i]->data) {
@@ -643,7 +2413,7 @@ int sstore_read_procmem(char *buf, char **start, off_t offset,
       len += sprintf(buf+len, "no data device %i\n", i);
     }
     
-    mutex_unlock(&sstore_devp[i]->sstore_mutex);
+    sstore_unlock(sstore_devp[i]);
   }
 
   *eof = 1;
@@ -653,7 +2423,10 @@ int sstore_read_procmem(char *buf, char **start, off_t offset,
 /* print statistics when reading /proc/sstore/stats
  * Currently this method prints the total number of read
  * operations and write operation since last time the
- * statistcs has been cleared.
+ * statistcs has been cleared. In dedup mode it also prints the
+ * number of distinct payloads and the memory saved by sharing them.
+ * It also prints the blobs with a time-to-live and the number of blobs
+ * that expired since the module was loaded.
  */
 int sstore_read_procstats(char *buf, char **start, off_t offset,
                        int count, int *eof, void *data)
@@ -666,17 +2439,633 @@ int sstore_read_procstats(char *buf, char **start, off_t offset,
 
 	/* acquire the mutex and print the statistics, number of read operations
 	 and write operations */
-    mutex_lock(&sstore_devp[i]->sstore_mutex);
+    sstore_lock(sstore_devp[i]);
     len += sprintf(buf+len, "reads: %i\t", sstore_devp[i]->nreads);
-    len += sprintf(buf+len, "writes: %i\n", sstore_devp[i]->nwrites);
+    len += sprintf(buf+len, "writes: %i", sstore_devp[i]->nwrites);
+    if (dedup) {
+      len += sprintf(buf+len, "\tpayloads: %lu\tdedup saved: %lu bytes",
+                     sstore_devp[i]->dedup_payloads,
+                     sstore_devp[i]->dedup_saved);
+    }
+    len += sprintf(buf+len, "\texpiring: %lu\texpired: %lu",
+                   sstore_devp[i]->nexpiring, sstore_devp[i]->nexpired);
+    if (sstore_devp[i]->queue) {
+      len += sprintf(buf+len, "\tenqueued: %lu\tdequeued: %lu",
+                     sstore_devp[i]->queue->tail,
+                     sstore_devp[i]->queue->head);
+    }
+    len += sprintf(buf+len, "\n");
+
+    sstore_unlock(sstore_devp[i]);
+  }
 
-    mutex_unlock(&sstore_devp[i]->sstore_mutex);
+  /* records per group shows how well the log batches writers */
+  if (sstore_wal) {
+    spin_lock(&sstore_wal->lock);
+    len += sprintf(buf+len, "Log: records: %llu\tdurable: %llu\t",
+                   sstore_wal->lsn, sstore_wal->durable_lsn);
+    spin_unlock(&sstore_wal->lock);
+    len += sprintf(buf+len, "groups: %lu\tsyncs: %lu\tcompactions: %lu\n",
+                   sstore_wal->groups, sstore_wal->syncs,
+                   sstore_wal->compactions);
   }
 
   *eof = 1;
   return len;
 }
 
+/*
+ * Write-ahead log writer
+ * Everything below runs in the log thread, or on load and unload.
+ */
+
+/* open '<wal_path>.<n>' */
+static struct file *
+sstore_wal_file(int n, int flags)
+{
+  struct file *file;
+  char *name;
+
+  name = kasprintf(GFP_KERNEL, "%s.%d", wal_path, n);
+  if (!name)
+    return ERR_PTR(-ENOMEM);
+  file = filp_open(name, flags | O_LARGEFILE, 0600);
+  kfree(name);
+  return file;
+}
+
+/* read or write all of 'buf' at *pos, short transfers fail with EIO */
+static int
+sstore_wal_io(struct file *file, char *buf, int len, loff_t *pos, int write)
+{
+  mm_segment_t old_fs = get_fs();
+  ssize_t n = 0;
+
+  set_fs(KERNEL_DS);
+  while (len > 0) {
+    if (write)
+      n = vfs_write(file, (const char __user *) buf, len, pos);
+    else
+      n = vfs_read(file, (char __user *) buf, len, pos);
+    if (n <= 0)
+      break;
+    buf += n;
+    len -= n;
+  }
+  set_fs(old_fs);
+
+  if (!len)
+    return 0;
+  return n < 0 ? n : -EIO;
+}
+
+/* fsync(2) for a kernel file */
+static int
+sstore_wal_fsync(struct file *file)
+{
+  struct address_space *mapping = file->f_mapping;
+  int ret, err;
+
+  if (!file->f_op || !file->f_op->fsync)
+    return -EINVAL;
+
+  ret = filemap_fdatawrite(mapping);
+  mutex_lock(&mapping->host->i_mutex);
+  err = file->f_op->fsync(file, file->f_path.dentry, 0);
+  mutex_unlock(&mapping->host->i_mutex);
+  if (!ret)
+    ret = err;
+  err = filemap_fdatawait(mapping);
+  if (!ret)
+    ret = err;
+  return ret;
+}
+
+static int
+sstore_wal_sync(struct sstore_wal *wal)
+{
+  wal->synced = jiffies;
+  wal->dirty = 0;
+  wal->syncs++;
+  return sstore_wal_fsync(wal->file);
+}
+
+/* the log can't be trusted anymore, fail every waiting and later write */
+static void
+sstore_wal_fail(struct sstore_wal *wal, int err)
+{
+  printk(KERN_ALERT "sstore: write-ahead log failed (%d)\n", err);
+  spin_lock(&wal->lock);
+  if (!wal->error)
+    wal->error = err;
+  spin_unlock(&wal->lock);
+  wake_up_all(&wal->space);
+  wake_up_all(&wal->done);
+}
+
+static int
+sstore_wal_pending(struct sstore_wal *wal)
+{
+  int used;
+
+  spin_lock(&wal->lock);
+  used = wal->used;
+  spin_unlock(&wal->lock);
+  return used != 0;
+}
+
+/*
+ * Group commit: swap the buffers, write the group writers filled since
+ * the previous commit with one system call, fsync it if wal_fsync is 1,
+ * and wake its writers. Once the log failed, groups are dropped instead,
+ * so nothing lands after a failed or short write, their writers already
+ * get the error.
+ */
+static void
+sstore_wal_commit(struct sstore_wal *wal)
+{
+  char *buf;
+  int len, err;
+  u64 lsn;
+
+  spin_lock(&wal->lock);
+  buf = wal->buf[wal->cur];
+  len = wal->used;
+  lsn = wal->lsn;
+  err = wal->error;
+  if (len) {
+    wal->cur ^= 1;
+    wal->used = 0;
+  }
+  spin_unlock(&wal->lock);
+  if (!len)
+    return;
+
+  /* the next group fills the other buffer meanwhile */
+  wake_up_all(&wal->space);
+  if (err) {
+    wake_up_all(&wal->done);
+    return;
+  }
+
+  err = sstore_wal_io(wal->file, buf, len, &wal->pos, 1);
+  wal->dirty = 1;
+  if (!err && wal_fsync == 1)
+    err = sstore_wal_sync(wal);
+  wal->groups++;
+  if (err) {
+    sstore_wal_fail(wal, err);
+    return;
+  }
+
+  spin_lock(&wal->lock);
+  wal->durable_lsn = lsn;
+  spin_unlock(&wal->lock);
+  wake_up_all(&wal->done);
+}
+
+/*
+ * Compaction
+ * Write a record for every live blob to the other log file, then its
+ * header with the next generation, and switch to it. The header is written
+ * last, once the snapshot is on disk, so a crash leaves the old log valid.
+ * Each device is locked only while its blobs are copied to the buffer, a
+ * full buffer is written with the device unlocked and the walk resumes
+ * from the first slot that did not fit. Records still in the pending
+ * buffer go to the new log, replaying them again is harmless.
+ */
+static int
+sstore_wal_compact(struct sstore_wal *wal)
+{
+  struct sstore_wal_header hdr;
+  struct sstore_wal_record rec;
+  struct sstore_dev *dev;
+  struct rb_node *node;
+  struct blob *blob;
+  struct file *file;
+  loff_t pos = sizeof (struct sstore_wal_header), hdr_pos = 0;
+  unsigned long j;
+  u64 now, expires;
+  char *buf;
+  int i, cursor, full, len = 0, err = 0;
+
+  file = sstore_wal_file(wal->active ^ 1, O_RDWR | O_CREAT | O_TRUNC);
+  if (IS_ERR(file))
+    return PTR_ERR(file);
+
+  /* writers only fill buf[cur], the other one is ours between commits */
+  spin_lock(&wal->lock);
+  buf = wal->buf[wal->cur ^ 1];
+  spin_unlock(&wal->lock);
+
+  /* one instant for the whole snapshot, the ttls left are taken from it */
+  j = jiffies;
+  now = sstore_wal_now_ms();
+
+  for (i = 0; i < NUM_MINOR_DEVICES && !err; i++) {
+    dev = sstore_devp[i];
+    cursor = 0;
+    do {
+      full = 0;
+      sstore_lock(dev);
+      blob = sstore_index_lookup(dev, cursor);
+      while (blob) {
+        if (!blob->expires || time_before(j, blob->expires)) {
+          if (len + SSTORE_WAL_LEN(blob->size) > wal->size) {
+            cursor = blob->index;
+            full = 1;
+            break;
+          }
+
+          expires = 0;
+          if (blob->expires)
+            expires = now + jiffies_to_msecs(time_after(blob->expires, j)
+                                             ? blob->expires - j : 0);
+          sstore_wal_record(&rec, SSTORE_CHANGE_WRITE, i, blob->index,
+                            blob->data, blob->size, expires);
+          memcpy(buf + len, &rec, sizeof (rec));
+          memcpy(buf + len + sizeof (rec), blob->data, blob->size);
+          len += SSTORE_WAL_LEN(blob->size);
+        }
+        node = rb_next(&blob->node);
+        blob = node ? rb_entry(node, struct blob, node) : NULL;
+      }
+      sstore_unlock(dev);
+
+      /* readers and writers of the device don't wait for the disk */
+      if (full) {
+        err = sstore_wal_io(file, buf, len, &pos, 1);
+        len = 0;
+      }
+    } while (full && !err);
+  }
+  if (!err)
+    err = sstore_wal_io(file, buf, len, &pos, 1);
+
+  /* the snapshot must be on disk before the header makes it valid */
+  if (!err)
+    err = sstore_wal_fsync(file);
+  if (!err) {
+    hdr.magic = SSTORE_WAL_MAGIC;
+    hdr.generation = wal->generation + 1;
+    hdr.crc = crc32(~0, (unsigned char *) &hdr.generation,
+                    sizeof (hdr.generation));
+    err = sstore_wal_io(file, (char *) &hdr, sizeof (hdr), &hdr_pos, 1);
+  }
+  if (!err)
+    err = sstore_wal_fsync(file);
+  if (err) {
+    filp_close(file, NULL);
+    return err;
+  }
+
+  if (wal->file)
+    filp_close(wal->file, NULL);
+  wal->file = file;
+  wal->active ^= 1;
+  wal->generation++;
+  wal->pos = pos;
+  wal->compact_at = pos + wal_compact_kb * 1024LL;
+  wal->synced = jiffies;
+  wal->dirty = 0;
+  wal->compactions++;
+  return 0;
+}
+
+/* the log thread, one group commit at a time */
+static int
+sstore_wal_thread(void *data)
+{
+  struct sstore_wal *wal = data;
+  int stop, err;
+
+  do {
+    wait_event_interruptible_timeout(wal->wait,
+             sstore_wal_pending(wal) || kthread_should_stop(), HZ);
+    /* commit what is left once more after a stop request */
+    stop = kthread_should_stop();
+
+    sstore_wal_commit(wal);
+
+    if (wal_fsync == 2 && wal->dirty && !wal->error
+        && (stop || time_after_eq(jiffies, wal->synced + HZ))) {
+      err = sstore_wal_sync(wal);
+      if (err)
+        sstore_wal_fail(wal, err);
+    }
+
+    if (!stop && !wal->error && wal_compact_kb > 0
+        && wal->pos > wal->compact_at) {
+      err = sstore_wal_compact(wal);
+      if (err) {
+        /* keep appending to the old log, try again later */
+        printk(KERN_ALERT "sstore: log compaction failed (%d)\n", err);
+        wal->compact_at = wal->pos + wal_compact_kb * 1024LL;
+      }
+    }
+  } while (!stop);
+
+  return 0;
+}
+
+/* the generation of log 'n', 0 if it has no valid header */
+static u64
+sstore_wal_generation(int n)
+{
+  struct sstore_wal_header hdr;
+  struct file *file;
+  loff_t pos = 0;
+  u64 generation = 0;
+
+  file = sstore_wal_file(n, O_RDONLY);
+  if (IS_ERR(file))
+    return 0;
+  if (!sstore_wal_io(file, (char *) &hdr, sizeof (hdr), &pos, 0)
+      && hdr.magic == SSTORE_WAL_MAGIC
+      && hdr.crc == crc32(~0, (unsigned char *) &hdr.generation,
+                          sizeof (hdr.generation)))
+    generation = hdr.generation;
+  filp_close(file, NULL);
+  return generation;
+}
+
+/*
+ * Replay log 'n' into the devices through the regular write and remove
+ * paths, up to the first torn or corrupt record. Runs on load, before the
+ * devices are visible and before sstore_wal is set, so nothing is logged
+ * twice. Records the current parameters reject are skipped.
+ */
+static void
+sstore_wal_replay(struct sstore_wal *wal, int n)
+{
+  struct sstore_wal_record rec;
+  struct data_buffer k_buf;
+  struct sstore_dev *dev;
+  struct file *file;
+  loff_t pos = sizeof (struct sstore_wal_header);
+  mm_segment_t old_fs;
+  char *data = wal->buf[0];
+  unsigned long records = 0, skipped = 0;
+  u64 now = sstore_wal_now_ms(), ttl;
+  u32 crc;
+  int ret;
+
+  file = sstore_wal_file(n, O_RDONLY);
+  if (IS_ERR(file))
+    return;
+
+  /* the replayed data comes from a kernel buffer */
+  old_fs = get_fs();
+  set_fs(KERNEL_DS);
+
+  while (!sstore_wal_io(file, (char *) &rec, sizeof (rec), &pos, 0)) {
+    if (rec.magic != SSTORE_WAL_RECORD_MAGIC || rec.size < 0)
+      break;
+
+    /* written with a larger max_blob_size, can't be stored anyway */
+    if (SSTORE_WAL_LEN(rec.size) > wal->size) {
+      pos += rec.size;
+      records++;
+      skipped++;
+      continue;
+    }
+
+    if (sstore_wal_io(file, data, rec.size, &pos, 0))
+      break;
+    crc = crc32(~0, (unsigned char *) &rec.expires_ms,
+                sizeof (struct sstore_wal_record)
+                - offsetof(struct sstore_wal_record, expires_ms));
+    if (crc32(crc, (unsigned char *) data, rec.size) != rec.crc)
+      break;
+
+    /* a log from a newer format, don't guess what the rest means */
+    if (rec.op != SSTORE_CHANGE_WRITE && rec.op != SSTORE_CHANGE_REMOVE) {
+      printk(KERN_ALERT "sstore: unknown log record %u, replay stopped\n",
+             rec.op);
+      break;
+    }
+    records++;
+
+    if (rec.dev >= NUM_MINOR_DEVICES) {
+      skipped++;
+      continue;
+    }
+    dev = sstore_devp[rec.dev];
+
+    if (rec.op == SSTORE_CHANGE_WRITE
+        && (!rec.expires_ms || rec.expires_ms > now)) {
+      k_buf.index = rec.index;
+      k_buf.size = rec.size;
+      k_buf.data = (char __user *) data;
+      ttl = rec.expires_ms ? rec.expires_ms - now : 0;
+      ret = sstore_store(dev, &k_buf, ttl > UINT_MAX ? UINT_MAX : ttl,
+                         NULL);
+    } else {
+      /* removes, and writes that expired while the module was unloaded */
+      ret = sstore_remove(dev, rec.index, NULL);
+      if (ret == -ENOTTY)
+        ret = 0;
+    }
+    if (ret < 0)
+      skipped++;
+  }
+
+  set_fs(old_fs);
+  filp_close(file, NULL);
+
+  printk(KERN_INFO "sstore: replayed %lu log records, %lu skipped\n",
+         records, skipped);
+}
+
+static void
+sstore_wal_free(struct sstore_wal *wal)
+{
+  if (wal->file)
+    filp_close(wal->file, NULL);
+  if (wal->buf[0])
+    vfree(wal->buf[0]);
+  if (wal->buf[1])
+    vfree(wal->buf[1]);
+  kfree(wal);
+}
+
+/*
+ * Turn the write-ahead log on, called on load with the device data
+ * allocated. The newest valid log is replayed, then compacted into the
+ * other one right away, so appends never follow a torn tail.
+ */
+static int
+sstore_wal_open(void)
+{
+  struct sstore_wal *wal;
+  u64 gen0, gen1;
+  int ret = 0;
+
+  wal = kzalloc(sizeof (struct sstore_wal), GFP_KERNEL);
+  if (!wal)
+    return -ENOMEM;
+
+  /* a buffer always holds at least one record */
+  wal->size = max_t(int, SSTORE_WAL_BUF_SIZE, SSTORE_WAL_LEN(max_blob_size));
+  wal->buf[0] = vmalloc(wal->size);
+  wal->buf[1] = vmalloc(wal->size);
+  if (!wal->buf[0] || !wal->buf[1]) {
+    sstore_wal_free(wal);
+    return -ENOMEM;
+  }
+  spin_lock_init(&wal->lock);
+  init_waitqueue_head(&wal->wait);
+  init_waitqueue_head(&wal->space);
+  init_waitqueue_head(&wal->done);
+
+  gen0 = sstore_wal_generation(0);
+  gen1 = sstore_wal_generation(1);
+  if (gen0 || gen1) {
+    wal->active = gen1 > gen0;
+    wal->generation = max(gen0, gen1);
+    sstore_wal_replay(wal, wal->active);
+  } else {
+    /* a new log, the first compaction creates '<wal_path>.0' */
+    wal->active = 1;
+  }
+
+  ret = sstore_wal_compact(wal);
+  if (!ret) {
+    wal->thread = kthread_run(sstore_wal_thread, wal, "sstore_wal");
+    if (IS_ERR(wal->thread))
+      ret = PTR_ERR(wal->thread);
+  }
+  if (ret) {
+    sstore_wal_free(wal);
+    return ret;
+  }
+
+  sstore_wal = wal;
+  printk(KERN_INFO "sstore: write-ahead log %s.%d, generation %llu\n",
+         wal_path, wal->active, wal->generation);
+  return 0;
+}
+
+/* commit the last group and close the log, on unload */
+static void
+sstore_wal_close(void)
+{
+  struct sstore_wal *wal = sstore_wal;
+
+  if (!wal)
+    return;
+  kthread_stop(wal->thread);
+  sstore_wal = NULL;
+  sstore_wal_free(wal);
+}
+
+/*
+ * debugfs instrumentation, /sys/kernel/debug/sstore/sstoreN
+ * Opening the file takes an atomic snapshot of the device instrumentation
+ * and formats it one record per line:
+ *   <counter> <value>
+ *   <histogram> count <n> sum_ns <ns> max_ns <ns> buckets <b0> .. <b31>
+ * so partial reads of the same open file always see the same snapshot.
+ * Writing anything to the file resets the instrumentation, independently
+ * of the clear timer.
+ */
+#define SSTORE_DEBUGFS_BUF_SIZE    (2 * PAGE_SIZE)
+
+struct sstore_debugfs_buf {
+  size_t len;
+  char data[SSTORE_DEBUGFS_BUF_SIZE];
+};
+
+static int
+sstore_debugfs_open(struct inode *inode, struct file *file)
+{
+  struct sstore_dev *dev = inode->i_private;
+  struct sstore_stats *snap;
+  struct sstore_debugfs_buf *out;
+  struct sstore_hist *hist;
+  size_t len = 0;
+  int i, j;
+
+  snap = kmalloc(sizeof (struct sstore_stats), GFP_KERNEL);
+  out = kmalloc(sizeof (struct sstore_debugfs_buf), GFP_KERNEL);
+  if (!snap || !out) {
+    kfree(snap);
+    kfree(out);
+    sstore_alloc_failed(dev);
+    return -ENOMEM;
+  }
+
+  spin_lock(&dev->stats_lock);
+  memcpy(snap, &dev->stats, sizeof (struct sstore_stats));
+  spin_unlock(&dev->stats_lock);
+
+  len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                   "lock_contended %llu\n",
+                   (unsigned long long) snap->lock_contended);
+  len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                   "alloc_failures %llu\n",
+                   (unsigned long long) snap->alloc_failures);
+  len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                   "wakeups %llu\n",
+                   (unsigned long long) snap->wakeups);
+  len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                   "overwrites_inplace %llu\n",
+                   (unsigned long long) snap->overwrites_inplace);
+  len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                   "overwrites_replaced %llu\n",
+                   (unsigned long long) snap->overwrites_replaced);
+
+  for (i = 0; i < SSTORE_NUM_HISTS; i++) {
+    hist = &snap->hist[i];
+    len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                     "%s count %llu sum_ns %llu max_ns %llu buckets",
+                     sstore_hist_names[i],
+                     (unsigned long long) hist->count,
+                     (unsigned long long) hist->sum_ns,
+                     (unsigned long long) hist->max_ns);
+    for (j = 0; j < SSTORE_HIST_BUCKETS; j++) {
+      len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len,
+                       " %llu", (unsigned long long) hist->buckets[j]);
+    }
+    len += scnprintf(out->data+len, SSTORE_DEBUGFS_BUF_SIZE-len, "\n");
+  }
+
+  kfree(snap);
+  out->len = len;
+  file->private_data = out;
+  return 0;
+}
+
+static ssize_t
+sstore_debugfs_read(struct file *file, char __user *buf,
+                    size_t count, loff_t *ppos)
+{
+  struct sstore_debugfs_buf *out = file->private_data;
+
+  return simple_read_from_buffer(buf, count, ppos, out->data, out->len);
+}
+
+static ssize_t
+sstore_debugfs_write(struct file *file, const char __user *buf,
+                     size_t count, loff_t *ppos)
+{
+  struct sstore_dev *dev = file->f_path.dentry->d_inode->i_private;
+
+  spin_lock(&dev->stats_lock);
+  memset(&dev->stats, 0, sizeof (struct sstore_stats));
+  spin_unlock(&dev->stats_lock);
+
+  printk(KERN_DEBUG "sstore: %s instrumentation reset\n", dev->name);
+  return count;
+}
+
+static int
+sstore_debugfs_release(struct inode *inode, struct file *file)
+{
+  kfree(file->private_data);
+  return 0;
+}
+
 module_init(sstore_init);
 module_exit(sstore_cleanup);
 MODULE_LICENSE("Dual BSD/GPL");
@@ -21,6 +21,22 @@
 /* Remove blob from the sstore */
 #define SSTORE_IOCREMOVE _IOW(SSTORE_IOC_MAGIC, 1, int)
 
+/* Copy all blobs in a range of indices, see struct sstore_scan */
+#define SSTORE_IOCSCAN _IOWR(SSTORE_IOC_MAGIC, 2, struct sstore_scan)
+
+/* Switch the device to FIFO queue mode until it is closed by all users,
+   write() enqueues and read() dequeues, the index is ignored */
+#define SSTORE_IOCQUEUE _IO(SSTORE_IOC_MAGIC, 3)
+
+/* Read change log records following a cursor, see struct sstore_changes */
+#define SSTORE_IOCCHANGES _IOWR(SSTORE_IOC_MAGIC, 4, struct sstore_changes)
+
+/* Allocate the submission/completion rings of this file descriptor */
+#define SSTORE_IOCRINGSETUP _IOWR(SSTORE_IOC_MAGIC, 5, struct sstore_ring_params)
+
+/* Doorbell, execute the queued submissions, returns how many */
+#define SSTORE_IOCRINGENTER _IO(SSTORE_IOC_MAGIC, 6)
+
 
 /* End IOCTL operations */
 
@@ -34,4 +50,132 @@ struct data_buffer {
     char *data;     /* where the data being transfered resides */
 };
 
+/* write request with a time-to-live, write() it with
+   count == sizeof (struct data_buffer_ttl) */
+struct data_buffer_ttl {
+    struct data_buffer buf;
+    unsigned int ttl_ms;      /* blob lifetime in ms, 0 never expires */
+};
+
+/* range scan request, blobs with index in [start, end) are returned */
+struct sstore_scan {
+    int start;      /* first index of the range */
+    int end;        /* end of the range, exclusive */
+    int cursor;     /* in: where to resume, out: first index not returned,
+                       equals end when the range has been exhausted */
+    int nentries;   /* out: number of entries copied to buf */
+    int buf_size;   /* size of buf */
+    char *buf;      /* packed struct sstore_scan_entry records */
+};
+
+/* one scanned blob, followed by 'size' bytes of data padded to
+   SSTORE_SCAN_ALIGN */
+struct sstore_scan_entry {
+    int index;
+    int size;
+};
+
+#define SSTORE_SCAN_ALIGN          sizeof (int)
+#define SSTORE_SCAN_ENTRY_LEN(size) \
+    ((sizeof (struct sstore_scan_entry) + (size) + SSTORE_SCAN_ALIGN - 1) \
+     & ~(SSTORE_SCAN_ALIGN - 1))
+
+/*
+ * Change log
+ * Every write, remove and expiry appends a record to a per-device ring. The ring can
+ * be read incrementally with SSTORE_IOCCHANGES, or mapped read only with
+ * mmap() at offset SSTORE_MMAP_CHANGELOG: a struct sstore_changelog_header
+ * followed by 'nrecords' records, the record with sequence s is at slot
+ * (s - 1) % nrecords. A mapped record is valid if its seq is the expected
+ * one both before and after reading it.
+ */
+#define SSTORE_CHANGE_WRITE        1
+#define SSTORE_CHANGE_REMOVE       2
+#define SSTORE_CHANGE_CLEAR        3   /* all blobs dropped, index is -1 */
+#define SSTORE_CHANGE_EXPIRE       4   /* blob time-to-live ran out */
+
+struct sstore_change {
+    unsigned long long seq;   /* sequence number, starting at 1 */
+    int op;                   /* SSTORE_CHANGE_* */
+    int index;                /* blob index */
+    int size;                 /* blob size after a write, 0 otherwise */
+    int pad;
+};
+
+struct sstore_changelog_header {
+    unsigned long long head;  /* sequence of the newest record */
+    unsigned int nrecords;    /* number of records in the ring */
+    unsigned int pad;
+};
+
+#define SSTORE_MMAP_CHANGELOG      0
+#define SSTORE_CHANGELOG_LEN(n) \
+    (sizeof (struct sstore_changelog_header) \
+     + (n) * sizeof (struct sstore_change))
+
+/* change log read request */
+struct sstore_changes {
+    unsigned long long cursor; /* in: last sequence seen, 0 at first,
+                                  out: last sequence returned */
+    int nrecords;             /* in: size of records, out: records copied */
+    int overflow;             /* out: records after cursor were lost */
+    struct sstore_change *records;
+};
+
+/*
+ * Submission/completion rings
+ * SSTORE_IOCRINGSETUP allocates a pair of rings for the file descriptor,
+ * mapped with mmap() at offset SSTORE_MMAP_RING and params.size bytes: a
+ * struct sstore_ring_header, the submission entries at sq_off, and the
+ * completion entries at cq_off. The client fills submission entries,
+ * publishes them by advancing sq_tail (after a write barrier), and rings the
+ * doorbell with SSTORE_IOCRINGENTER. The kernel executes them in order,
+ * advances sq_head, and posts one completion per submission before
+ * advancing cq_tail. The client consumes completions and advances cq_head.
+ * All indices are free running, entry i lives at i & (entries - 1).
+ */
+#define SSTORE_OP_NOP              0
+#define SSTORE_OP_WRITE            1   /* like write() */
+#define SSTORE_OP_READ             2   /* like read(), fails with EAGAIN
+                                          instead of blocking */
+#define SSTORE_OP_REMOVE           3   /* like SSTORE_IOCREMOVE */
+
+struct sstore_sqe {
+    unsigned long long user_data; /* copied to the completion */
+    unsigned long long addr;  /* user buffer with the data */
+    int op;                   /* SSTORE_OP_* */
+    int index;
+    int size;
+    unsigned int ttl_ms;      /* SSTORE_OP_WRITE time-to-live, 0 for none */
+};
+
+struct sstore_cqe {
+    unsigned long long user_data;
+    int res;                  /* bytes transfered, 0, or -errno */
+    unsigned int flags;
+};
+
+struct sstore_ring_header {
+    unsigned int sq_head;     /* written by the kernel */
+    unsigned int sq_tail;     /* written by the client */
+    unsigned int cq_head;     /* written by the client */
+    unsigned int cq_tail;     /* written by the kernel */
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    unsigned int sq_off;      /* offset of the submission entries */
+    unsigned int cq_off;      /* offset of the completion entries */
+};
+
+struct sstore_ring_params {
+    unsigned int sq_entries;  /* in: wanted, out: rounded to a power of 2 */
+    unsigned int cq_entries;  /* out */
+    unsigned int size;        /* out: bytes to mmap */
+};
+
+#define SSTORE_MMAP_RING           0x10000000
+#define SSTORE_RING_MAX_ENTRIES    4096
+#define SSTORE_RING_SQ_OFF         64
+#define SSTORE_RING_CQ_OFF(n) \
+    (SSTORE_RING_SQ_OFF + (n) * sizeof (struct sstore_sqe))
+
 #endif
@@ -12,6 +12,7 @@
 #include <fcntl.h>
 
 #include "sstore.h"
+#include "test_common.h"
 
 
 
@@ -35,6 +36,11 @@ int main() {
   test_read(3, 25, data, 0);
   printf("Data: %s\n", data);
 
+  /* overwrite with shorter data, updated in place */
+  test_write(4, 10, "overwrite\0", 0);
+  test_read(4, 25, data, 0);
+  printf("Data: %s\n", data);
+
   printf("Delete blob... \n");
   test_del(3, 0);
 
@@ -12,6 +12,7 @@
 #include <fcntl.h>
 
 #include "sstore.h"
+#include "test_common.h"
 
 
 
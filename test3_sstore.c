@@ -0,0 +1,53 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sstore.h"
+#include "test_common.h"
+
+
+
+int main() {
+
+  unsigned long long cursor;
+
+  test_write(0, 5, "zero\0", 0);
+  test_write(1, 4, "one\0", 0);
+  test_write(3, 6, "three\0", 0);
+  test_write(4, 5, "four\0", 0);
+
+  /* whole store in one call */
+  test_scan(0, 5, 256, 0);
+
+  /* [1, 4) skips the empty slot 2 */
+  test_scan(1, 4, 256, 0);
+
+  /* buffer fits one entry at a time, resumes with the cursor */
+  test_scan(0, 5, 16, 0);
+
+  /* buffer too small for any entry */
+  test_scan(0, 5, 4, 0);
+
+  /* the change log has the four writes, then the remove */
+  cursor = test_changes(0, 0);
+  test_del(1, 0);
+  cursor = test_changes(cursor, 0);
+
+  /* blob 2 is gone once its time-to-live runs out */
+  test_write_ttl(2, 4, "ttl\0", 500, 0);
+  test_scan(0, 5, 256, 0);
+  sleep(1);
+  test_scan(0, 5, 256, 0);
+  test_changes(cursor, 1);
+
+}
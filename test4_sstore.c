@@ -0,0 +1,93 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Submission/completion rings: queue writes, reads and a remove, ring
+ * the doorbell once, then print the completions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "sstore.h"
+
+
+struct sstore_ring_header *hdr;
+struct sstore_sqe *sqes;
+struct sstore_cqe *cqes;
+
+/* queue one submission, published later by submit() */
+void queue_op(int op, int index, int size, void *data, int tag) {
+  struct sstore_sqe *sqe;
+
+  sqe = &sqes[hdr->sq_tail & (hdr->sq_entries - 1)];
+  sqe->user_data = tag;
+  sqe->addr = (unsigned long) data;
+  sqe->op = op;
+  sqe->index = index;
+  sqe->size = size;
+  sqe->ttl_ms = 0;
+  __sync_synchronize();
+  hdr->sq_tail++;
+}
+
+int main() {
+  struct sstore_ring_params params;
+  struct sstore_cqe *cqe;
+  char out[3][25];
+  void *map;
+  int fd, n;
+
+  fd = open("/dev/sstore0", O_RDWR);
+  if (fd < 0) {
+    perror("opening sstore0");
+    return 1;
+  }
+
+  params.sq_entries = 8;
+  if (ioctl(fd, SSTORE_IOCRINGSETUP, &params) < 0) {
+    perror("SSTORE_IOCRINGSETUP");
+    return 1;
+  }
+  printf("rings: %u submissions, %u completions, %u bytes\n",
+         params.sq_entries, params.cq_entries, params.size);
+
+  map = mmap(NULL, params.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             SSTORE_MMAP_RING);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  hdr = map;
+  sqes = (struct sstore_sqe *) ((char *) map + hdr->sq_off);
+  cqes = (struct sstore_cqe *) ((char *) map + hdr->cq_off);
+
+  queue_op(SSTORE_OP_WRITE, 0, 25, "11111222223333344444data\0", 1);
+  queue_op(SSTORE_OP_WRITE, 1, 25, "aaaaabbbbbcccccdddddeeee\0", 2);
+  queue_op(SSTORE_OP_READ, 0, 25, out[0], 3);
+  queue_op(SSTORE_OP_READ, 1, 25, out[1], 4);
+  queue_op(SSTORE_OP_REMOVE, 1, 0, NULL, 5);
+  /* the slot is empty now, fails with EAGAIN instead of blocking */
+  queue_op(SSTORE_OP_READ, 1, 25, out[2], 6);
+
+  n = ioctl(fd, SSTORE_IOCRINGENTER);
+  printf("doorbell consumed %i submissions\n", n);
+
+  while (hdr->cq_head != hdr->cq_tail) {
+    __sync_synchronize();
+    cqe = &cqes[hdr->cq_head & (hdr->cq_entries - 1)];
+    printf("completion %llu: %i\n", cqe->user_data, cqe->res);
+    hdr->cq_head++;
+  }
+  printf("Data: %s\nData: %s\n", out[0], out[1]);
+
+  munmap(map, params.size);
+  close(fd);
+  return 0;
+}
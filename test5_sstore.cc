@@ -0,0 +1,61 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * libsstore: synchronous writes and reads through a Device, then a batch
+ * of asynchronous writes, reads and a failing read through a Client.
+ */
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <system_error>
+#include <vector>
+
+#include "libsstore.h"
+
+
+int main() {
+  char out[3][25];
+  int i, n;
+
+  try {
+    sstore::Device dev("/dev/sstore0");
+
+    n = dev.write(0, "device blob", 12);
+    printf("Device::write 0: %d bytes\n", n);
+    n = dev.read(0, out[0], sizeof (out[0]));
+    printf("Device::read 0: %d bytes '%s'\n", n, out[0]);
+
+    sstore::Client client("/dev/sstore0", 8, 8);
+    std::vector<std::future<int> > writes;
+
+    writes.push_back(client.write_async(1, "async blob 1", 13));
+    writes.push_back(client.write_async(2, "async blob 2", 13));
+    writes.push_back(client.write_async(3, "async blob 3", 13));
+    std::future<int> removed = client.remove_async(3);
+    std::future<int> reads[3];
+    for (i = 0; i < 3; i++)
+      reads[i] = client.read_async(i + 1, out[i], sizeof (out[i]));
+    printf("queued %u operations\n", client.queued());
+
+    /* one doorbell for the whole batch */
+    client.flush();
+    for (i = 0; i < 3; i++)
+      printf("write_async %d: %d bytes\n", i + 1, writes[i].get());
+    printf("remove_async 3: %d\n", removed.get());
+    for (i = 0; i < 2; i++) {
+      n = reads[i].get();
+      printf("read_async %d: %d bytes '%s'\n", i + 1, n, out[i]);
+    }
+    try {
+      reads[2].get();
+      printf("read_async 3: should have failed\n");
+    } catch (const std::system_error &e) {
+      printf("read_async 3: %s\n", e.what());
+    }
+  } catch (const std::system_error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
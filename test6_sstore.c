@@ -0,0 +1,99 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Write-ahead log: "prog6 write" writes every slot of sstore0 from one
+ * process per slot at once, so their writes share group commits, then
+ * removes slot 0. After reloading the module with the same wal_path,
+ * "prog6 check" reads the slots back without blocking.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include "sstore.h"
+
+
+/* max_num_blobs of the loaded module */
+int num_blobs(void) {
+  FILE *f = fopen("/sys/module/sstore/parameters/max_num_blobs", "r");
+  int n = 5;
+
+  if (f) {
+    if (fscanf(f, "%d", &n) != 1)
+      n = 5;
+    fclose(f);
+  }
+  return n;
+}
+
+void write_slot(int fd, int index) {
+  struct data_buffer buf;
+  char data[16];
+
+  snprintf(data, sizeof (data), "durable %d", index);
+  buf.index = index;
+  buf.size = strlen(data) + 1;
+  buf.data = data;
+  if (write(fd, &buf, sizeof (struct data_buffer)) < 0)
+    perror("write");
+}
+
+void check_slot(int fd, int index) {
+  struct data_buffer buf;
+  char data[16];
+
+  buf.index = index;
+  buf.size = sizeof (data);
+  buf.data = data;
+  if (read(fd, &buf, sizeof (struct data_buffer)) < 0)
+    printf("slot %i: empty\n", index);
+  else
+    printf("slot %i: '%s'\n", index, data);
+}
+
+int main(int argc, char **argv) {
+  int fd, i, n = num_blobs();
+  int index = 0;
+
+  if (argc < 2 || (strcmp(argv[1], "write") && strcmp(argv[1], "check"))) {
+    fprintf(stderr, "usage: %s write|check\n", argv[0]);
+    return 1;
+  }
+
+  /* missing slots fail with EAGAIN instead of blocking */
+  fd = open("/dev/sstore0", O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("opening sstore0");
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "check")) {
+    /* slot 0 was removed */
+    for (i = 0; i < n; i++)
+      check_slot(fd, i);
+    close(fd);
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (fork() == 0) {
+      write_slot(fd, i);
+      exit(0);
+    }
+  }
+  while (wait(NULL) > 0)
+    ;
+  if (ioctl(fd, SSTORE_IOCREMOVE, &index) < 0)
+    perror("SSTORE_IOCREMOVE");
+  printf("wrote %i slots, removed slot 0\n", n);
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Queue mode: switch sstore1 to a queue, dequeue from the empty queue,
+ * enqueue two messages, try to dequeue with an empty and a short buffer,
+ * then dequeue both messages in order.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include "sstore.h"
+
+
+void enqueue(int fd, char *data) {
+  struct data_buffer buf;
+  int n;
+
+  buf.index = 0;
+  buf.size = strlen(data) + 1;
+  buf.data = data;
+  n = write(fd, &buf, sizeof (struct data_buffer));
+  if (n < 0)
+    perror("enqueue");
+  else
+    printf("enqueued '%s', %i bytes\n", data, n);
+}
+
+void dequeue(int fd, int size) {
+  struct data_buffer buf;
+  char data[32];
+  int n;
+
+  memset(data, 0, sizeof (data));
+  buf.index = 0;
+  buf.size = size;
+  buf.data = data;
+  n = read(fd, &buf, sizeof (struct data_buffer));
+  if (n < 0)
+    printf("dequeue into %i bytes: %s\n", size, strerror(errno));
+  else
+    printf("dequeued '%s', %i bytes\n", data, n);
+}
+
+int main() {
+  int fd;
+
+  /* an empty queue fails with EAGAIN instead of blocking */
+  fd = open("/dev/sstore1", O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("opening sstore1");
+    return 1;
+  }
+  if (ioctl(fd, SSTORE_IOCQUEUE) < 0) {
+    perror("SSTORE_IOCQUEUE");
+    close(fd);
+    return 1;
+  }
+
+  /* EAGAIN */
+  dequeue(fd, 32);
+
+  enqueue(fd, "first");
+  enqueue(fd, "second message");
+
+  /* EINVAL, then ENOSPC, neither takes the message */
+  dequeue(fd, 0);
+  dequeue(fd, 3);
+
+  /* 'first', then 'second message', then EAGAIN */
+  dequeue(fd, 32);
+  dequeue(fd, 32);
+  dequeue(fd, 32);
+
+  close(fd);
+  return 0;
+}
@@ -10,8 +10,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "sstore.h"
+#include "test_common.h"
 
 
 int sstore_dev = -1;
@@ -40,6 +43,33 @@ void test_write(int index, int size, void *data, char need_close) {
 
 }
 
+/* test write operation with a time-to-live */
+
+void test_write_ttl(int index, int size, void *data, unsigned int ttl_ms,
+                    char need_close) {
+
+  int written = 0;
+  struct data_buffer_ttl buf;
+
+  sstore_dev = open("/dev/sstore0", O_RDWR, S_IRWXU);
+  if (sstore_dev < 0)
+	perror("opening sstore0");
+  buf.buf.index = index;
+  buf.buf.size = size;
+  buf.buf.data = data;
+  buf.ttl_ms = ttl_ms;
+  
+  printf("write to sstore0 index:%i size:%i ttl:%ums ..\n", index, size,
+         ttl_ms); 
+  written = write(sstore_dev, &buf, sizeof (struct data_buffer_ttl));
+  if (written < 0)
+    perror("write");
+
+  if (need_close)
+    close(sstore_dev);
+
+}
+
 /* test read() operation */
 
 void test_read(int index, int size, void* data, char need_close) {
@@ -77,3 +107,77 @@ void test_del(int index, char need_close) {
 }
 
 
+/* test range scan ioctl, prints every blob in [start, end), resuming
+   with the cursor whenever the buffer fills up */
+
+void test_scan(int start, int end, int buf_size, char need_close) {
+  struct sstore_scan scan;
+  struct sstore_scan_entry *entry;
+  char *buf;
+  int n, used;
+
+  sstore_dev = open("/dev/sstore0", O_RDONLY, S_IRWXU);
+  if (sstore_dev < 0)
+	perror("opening sstore0");
+
+  buf = malloc(buf_size);
+  scan.start = start;
+  scan.end = end;
+  scan.cursor = start;
+  scan.buf_size = buf_size;
+  scan.buf = buf;
+
+  printf("scan sstore0 indices [%i, %i) buffer:%i ..\n", start, end, buf_size);
+  while (scan.cursor < scan.end) {
+    n = ioctl(sstore_dev, SSTORE_IOCSCAN, &scan);
+    if (n < 0) {
+      perror("scan");
+      break;
+    }
+    printf("got %i entries, cursor %i\n", n, scan.cursor);
+    for (used = 0; n > 0; n--) {
+      entry = (struct sstore_scan_entry *) (buf + used);
+      printf("  index %i size %i data: %.*s\n", entry->index, entry->size,
+             entry->size, (char *) (entry + 1));
+      used += SSTORE_SCAN_ENTRY_LEN(entry->size);
+    }
+  }
+  free(buf);
+
+  if (need_close)
+    close(sstore_dev);
+}
+
+/* test change log ioctl, prints the records after 'cursor' and returns
+   the new cursor */
+
+unsigned long long test_changes(unsigned long long cursor, char need_close) {
+  struct sstore_changes req;
+  struct sstore_change records[8];
+  int n, i;
+
+  sstore_dev = open("/dev/sstore0", O_RDONLY, S_IRWXU);
+  if (sstore_dev < 0)
+	perror("opening sstore0");
+
+  printf("changes on sstore0 after %llu ..\n", cursor);
+  req.cursor = cursor;
+  do {
+    req.nrecords = 8;
+    req.records = records;
+    n = ioctl(sstore_dev, SSTORE_IOCCHANGES, &req);
+    if (n < 0) {
+      perror("changes");
+      break;
+    }
+    if (req.overflow)
+      printf("  overflow, records were lost\n");
+    for (i = 0; i < n; i++)
+      printf("  seq %llu op %i index %i size %i\n", records[i].seq,
+             records[i].op, records[i].index, records[i].size);
+  } while (n == 8);
+
+  if (need_close)
+    close(sstore_dev);
+  return req.cursor;
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2010 Abdelhalim Ragab (abdelhalim@r8t.org)
+ *
+ * Helpers shared by the test programs, see test_common.c
+ */
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+void test_write(int index, int size, void *data, char need_close);
+void test_write_ttl(int index, int size, void *data, unsigned int ttl_ms,
+                    char need_close);
+void test_read(int index, int size, void* data, char need_close);
+void test_del(int index, char need_close);
+void test_scan(int start, int end, int buf_size, char need_close);
+unsigned long long test_changes(unsigned long long cursor, char need_close);
+
+#endif